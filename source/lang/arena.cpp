@@ -0,0 +1,59 @@
+#include "arena.h"
+#include <algorithm>
+#include <new>
+
+thread_local NodeArena *currentArena = nullptr;
+
+void *NodeArena::allocate(size_t size) {
+  size = (size + ALIGN - 1) & ~(ALIGN - 1);
+  size_t cls = size / ALIGN - 1;
+  if (cls >= SIZE_CLASSES)
+    return ::operator new(size);
+
+  counters.allocations++;
+  counters.peakLive = std::max(counters.peakLive, ++live);
+
+  if (FreeBlock *block = freeLists[cls]) {
+    freeLists[cls] = block->next;
+    counters.reused++;
+    return block;
+  }
+
+  if (static_cast<size_t>(limit - cursor) < size) {
+    cursor = static_cast<char *>(::operator new(CHUNK_SIZE));
+    limit = cursor + CHUNK_SIZE;
+    chunks.push_back(cursor);
+    counters.chunks++;
+  }
+  void *p = cursor;
+  cursor += size;
+  return p;
+}
+
+void NodeArena::deallocate(void *p, size_t size) {
+  size = (size + ALIGN - 1) & ~(ALIGN - 1);
+  size_t cls = size / ALIGN - 1;
+  if (cls >= SIZE_CLASSES) {
+    ::operator delete(p);
+    return;
+  }
+
+  auto *block = static_cast<FreeBlock *>(p);
+  block->next = freeLists[cls];
+  freeLists[cls] = block;
+  if (--live == 0 && closed)
+    delete this;
+}
+
+void NodeArena::close() {
+  closed = true;
+  if (live == 0)
+    delete this;
+}
+
+NodeArena::~NodeArena() {
+  if (tables)
+    freeConsTables(tables);
+  for (char *chunk : chunks)
+    ::operator delete(chunk);
+}
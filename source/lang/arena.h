@@ -0,0 +1,70 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+/*
+    Node arena
+    ----------
+    Term and type nodes built while a program compiles are carved out of
+    64kb chunks of its context's arena (see context.h), instead of one
+    malloc each (see makeRef() in ref.h). Every pass rebuilds the tree, so
+    the nodes freed by one pass go on per-size free lists and are reused by
+    the next. The arena also holds the tables its nodes are hash-consed in.
+    The chunks are released together once the context has closed the arena
+    and the last node allocated from it died
+*/
+struct ConsTables; // syntax.cpp
+void freeConsTables(ConsTables *tables);
+
+class NodeArena {
+public:
+  struct Stats {
+    size_t chunks = 0;      // chunks taken from the system allocator
+    size_t allocations = 0; // nodes handed out
+    size_t reused = 0;      // of which came off a free list
+    size_t peakLive = 0;    // most nodes alive at once
+  };
+
+  void *allocate(size_t size);
+  void deallocate(void *p, size_t size);
+
+  // No more allocations, the arena frees itself when the last node dies
+  void close();
+
+  const Stats &stats() const { return counters; }
+
+  // Created by the first node interned here, see syntax.cpp
+  ConsTables *tables = nullptr;
+
+private:
+  static constexpr size_t CHUNK_SIZE = 64 * 1024;
+  static constexpr size_t ALIGN = alignof(std::max_align_t);
+  static constexpr size_t SIZE_CLASSES = 32; // up to 512 bytes
+
+  struct FreeBlock {
+    FreeBlock *next;
+  };
+
+  std::vector<char *> chunks;
+  char *cursor = nullptr, *limit = nullptr;
+  FreeBlock *freeLists[SIZE_CLASSES] = {};
+  size_t live = 0;
+  bool closed = false;
+  Stats counters;
+
+  ~NodeArena();
+  friend class Context;
+};
+
+// Arena new nodes are allocated from on this thread, nullptr for the
+// system allocator
+extern thread_local NodeArena *currentArena;
+
+// Run `make` with no arena installed, for immortal nodes (see ref.h)
+template <typename F> auto outsideArena(F make) {
+  NodeArena *arena = currentArena;
+  currentArena = nullptr;
+  auto out = make();
+  currentArena = arena;
+  return out;
+}
@@ -0,0 +1,15 @@
+#include "context.h"
+#include "stdlib/stdlib.h"
+#include <iostream>
+
+thread_local Context *currentContext = nullptr;
+
+Context::Context() : Context(std::cerr) {}
+
+Context::Context(std::ostream &diagnostics)
+    : Context(diagnostics, ::primitives) {}
+
+Context::Context(std::ostream &diagnostics, const PrimitiveTable &primitives)
+    : nodes(new NodeArena), prims(primitives), diag(diagnostics) {}
+
+Context::~Context() { nodes->close(); }
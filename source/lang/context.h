@@ -0,0 +1,76 @@
+#pragma once
+#include "arena.h"
+#include "symbol.h"
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+
+struct Primitive;
+using PrimitiveTable = std::unordered_map<Symbol, const Primitive *>;
+
+/*
+    Compilation context
+    -------------------
+    Everything compiling and running one program touches besides the
+    program itself: the arena its nodes come from, which holds the tables
+    they are hash-consed in, the counter naming its unknown types, the
+    primitives it may call and the stream diagnostics go to.
+
+    typecheck(), reduce(), compileTerm() and Execution take a context and
+    install it on the calling thread for the node factories below them, as
+    the running program's heap is installed for the runtime. Programs
+    compiled in contexts of their own share nothing mutable but the symbol
+    table, which locks, so they can be compiled and run on separate
+    threads. A context is used by one thread at a time.
+
+    Nodes built with no context installed, the primitives' types and the
+    singletons of syntax.cpp, are immortal and shared by every thread (see
+    ref.h)
+*/
+class Context {
+public:
+  // The standard library's primitives, diagnostics on stderr
+  Context();
+  explicit Context(std::ostream &diagnostics);
+  Context(std::ostream &diagnostics, const PrimitiveTable &primitives);
+  // The arena lives on until the last node allocated from it died
+  ~Context();
+  Context(const Context &) = delete;
+  Context &operator=(const Context &) = delete;
+
+  NodeArena *arena() const { return nodes; }
+  const PrimitiveTable &primitives() const { return prims; }
+  std::ostream &diagnostics() const { return diag; }
+
+  // Number for the next unknown type, `?tN`
+  uint64_t freshUnknown() { return unknowns++; }
+
+private:
+  NodeArena *nodes;
+  const PrimitiveTable &prims;
+  std::ostream &diag;
+  uint64_t unknowns = 0;
+};
+
+// Context of the program being compiled or run on this thread, if any
+extern thread_local Context *currentContext;
+
+// Installs `context` and its arena for its lifetime
+class ContextScope {
+public:
+  explicit ContextScope(Context &context)
+      : savedContext(currentContext), savedArena(currentArena) {
+    currentContext = &context;
+    currentArena = context.arena();
+  }
+  ~ContextScope() {
+    currentContext = savedContext;
+    currentArena = savedArena;
+  }
+  ContextScope(const ContextScope &) = delete;
+  ContextScope &operator=(const ContextScope &) = delete;
+
+private:
+  Context *savedContext;
+  NodeArena *savedArena;
+};
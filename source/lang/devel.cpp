@@ -1,21 +1,1055 @@
 #include "../Notepad3DS/source/file_io.h"
 #include "../globals.h"
+#include "image.h"
 #include "interpreter.h"
+#include "parser/driver.hpp"
+#include "runtime/bytecode.h"
+#include "runtime/pool.h"
+#include "session.h"
+#include <cctype>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <optional>
+#include <sstream>
 #include <string>
+#include <sys/resource.h>
+#include <unistd.h>
 
-void stepCallback(State state) {
-  
+// Heap of the programs run below, set from the command line
+static Heap::Config heapConfig;
+static bool gcStats = false;
+// Parse with the flex scanner, --bench-parse and --batch (see driver.hpp)
+static bool flexScanner = false;
+
+/*
+    Allocation counting for --bench-parse: while a CountAllocations is
+    alive, allocations made on its thread add to it. Replacing operator
+    new replaces it for the whole binary, so every form of it and of
+    operator delete is replaced to match. Outside a count they cost a test
+*/
+static thread_local size_t *allocationCount = nullptr;
+
+struct CountAllocations {
+  size_t count = 0;
+  CountAllocations() { allocationCount = &count; }
+  ~CountAllocations() { allocationCount = nullptr; }
+};
+
+static void *allocate(size_t size) noexcept {
+  if (allocationCount)
+    ++*allocationCount;
+  return std::malloc(size ? size : 1);
+}
+
+void *operator new(size_t size) {
+  if (void *p = allocate(size))
+    return p;
+  throw std::bad_alloc();
+}
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size);
+}
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size);
+}
+
+// Not inlined into callers, where GCC would see free() given what the
+// builtin operator new returned
+[[gnu::noinline]] void operator delete(void *p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete[](void *p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void *p, size_t) noexcept {
+  std::free(p);
+}
+[[gnu::noinline]] void operator delete[](void *p, size_t) noexcept {
+  std::free(p);
+}
+[[gnu::noinline]] void operator delete(void *p,
+                                       const std::nothrow_t &) noexcept {
+  std::free(p);
+}
+[[gnu::noinline]] void operator delete[](void *p,
+                                         const std::nothrow_t &) noexcept {
+  std::free(p);
+}
+
+// Run `prog` to completion, in slices of `fuel` steps if given. Returns
+// Error if it failed
+static ReturnCode execute(Term prog, Context &context, Engine engine,
+                          size_t fuel = 0) {
+  Execution exec(prog, context, engine);
+  exec.heap().config = heapConfig;
+  size_t slices = 1;
+  ReturnCode code;
+  while ((code = exec.run({.steps = fuel})) == OutOfFuel)
+    slices++;
+  if (fuel)
+    std::cout << "\nfuel: " << slices << " slices of " << fuel << " steps"
+              << std::endl;
+
+  if (!gcStats)
+    return code;
+  auto &gc = exec.heap().stats();
+  std::cerr << "gc: " << gc.minor << " minor, " << gc.major
+            << " major collections, pauses " << gc.pauseMicros
+            << " us total, " << gc.maxPauseMicros << " us max" << std::endl;
+  std::cerr << "gc: " << (gc.allocated >> 10) << " kb allocated, "
+            << (gc.promoted >> 10) << " kb promoted, " << (gc.freed >> 10)
+            << " kb freed, peak heap " << (gc.peak >> 10) << " kb"
+            << std::endl;
+  return code;
+}
+
+/*
+    Stress program for deep spines:
+    `let n = 0 in` followed by `count` statements alternating
+    `let n = succ n in` and `print_string "";`, then `print_int n`.
+    `make stress` runs it on every engine, failing if one does
+*/
+static Term stressProgram(size_t count) {
+  auto var = [](const char *name) {
+    return TermNode::VarTerm(Symbol::intern(name), TermNode::Var::Free,
+                             TypeNode::Unknown());
+  };
+
+  Symbol n = Symbol::intern("n");
+  Term prog = TermNode::AppTerm(var("print_int"), var("n"));
+  for (size_t i = count; i-- > 0;) {
+    if (i % 2)
+      prog = TermNode::LetTerm(
+          n, TypeNode::Unknown(), TermNode::AppTerm(var("succ"), var("n")),
+          prog);
+    else
+      prog = TermNode::LetTerm(
+          Symbol(), TypeNode::Unit(),
+          TermNode::AppTerm(var("print_string"), TermNode::String("")), prog);
+  }
+  return TermNode::LetTerm(n, TypeNode::Unknown(), TermNode::Int(0), prog);
+}
+
+static int stress(size_t count, Engine engine) {
+  using clock = std::chrono::steady_clock;
+  auto ms = [](clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+  };
+
+  auto t0 = clock::now();
+  Context context;
+  Term prog;
+  {
+    ContextScope scope(context);
+    prog = compileTerm(stressProgram(count), context);
+  }
+  NodeArena::Stats nodes = context.arena()->stats();
+  if (!prog)
+    return 1;
+  auto t1 = clock::now();
+  ReturnCode code = execute(prog, context, engine);
+  auto t2 = clock::now();
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  std::cout << "\nstress: " << count << " statements (expect " << count / 2
+            << "), compile " << ms(t1 - t0) << " ms, run " << ms(t2 - t1)
+            << " ms" << std::endl;
+  std::cout << "stress: " << nodes.allocations << " nodes (" << nodes.reused
+            << " reused, peak " << nodes.peakLive << " live) in "
+            << nodes.chunks << " chunks, max rss " << usage.ru_maxrss / 1024
+            << " MB" << std::endl;
+  return code != Ok;
+}
+
+/*
+    Output benchmark: `count` lines `print_int k; print_endline "";` run
+    once per flush policy (newline is the old flush-every-line behaviour),
+    reported on stderr so stdout can be redirected
+*/
+static int benchPrint(size_t count, Engine engine) {
+  using clock = std::chrono::steady_clock;
+  Context context;
+  ContextScope scope(context);
+  auto var = [](const char *name) {
+    return TermNode::VarTerm(Symbol::intern(name), TermNode::Var::Free,
+                             TypeNode::Unknown());
+  };
+
+  Term src = TermNode::Unit();
+  for (size_t i = count; i-- > 0;) {
+    src = TermNode::LetTerm(
+        Symbol(), TypeNode::Unit(),
+        TermNode::AppTerm(var("print_endline"), TermNode::String("")), src);
+    src = TermNode::LetTerm(
+        Symbol(), TypeNode::Unit(),
+        TermNode::AppTerm(var("print_int"), TermNode::Int(i % 10000)), src);
+  }
+  Term prog = compileTerm(src, context);
+  if (!prog)
+    return 1;
+
+  const std::pair<const char *, OutChannel::FlushPolicy> policies[] = {
+      {"newline", OutChannel::OnNewline},
+      {"size", OutChannel::OnSize},
+      {"run", OutChannel::PerRun},
+      {"end", OutChannel::AtEnd}};
+
+  for (auto [name, policy] : policies) {
+    Execution exec(prog, context, engine);
+    exec.output().policy = policy;
+
+    auto t0 = clock::now();
+    exec.run();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  clock::now() - t0)
+                  .count();
+    std::cerr << "bench-print: flush " << name << ": " << ns / count
+              << " ns per print_int" << std::endl;
+  }
+  return 0;
+}
+
+/*
+    Pass benchmark: substitute() and infer() over the resolved stress
+    program, `rounds` times each, reported on stderr. substitute() recurses
+    down the let spine, so keep `count` within the native stack
+*/
+static int benchPasses(size_t count) {
+  using clock = std::chrono::steady_clock;
+  const int rounds = 50;
+  Context context;
+  ContextScope scope(context);
+  auto prepare = [&] {
+    return resolve(primitiveArgs(stressProgram(count), context.primitives()),
+                   context.primitives());
+  };
+
+  Term prog = prepare();
+  Term one = TermNode::Int(1);
+  Symbol x = Symbol::intern("x");
+  clock::duration substituteTime{}, inferTime{};
+  for (int i = 0; i < rounds; i++) {
+    auto t0 = clock::now();
+    Term out = substitute(prog, x, one, 0);
+    substituteTime += clock::now() - t0;
+  }
+  for (int i = 0; i < rounds; i++) {
+    Term fresh = prepare();
+    EnvType env;
+    auto t0 = clock::now();
+    infer(fresh, env);
+    inferTime += clock::now() - t0;
+  }
+
+  auto perNode = [count, rounds](clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() /
+           (count * rounds);
+  };
+  std::cerr << "bench-passes: substitute " << perNode(substituteTime)
+            << " ns, infer " << perNode(inferTime) << " ns per statement"
+            << std::endl;
+  return 0;
+}
+
+/*
+    Lexer benchmark: a generated source of about `megabytes` MB, definitions
+    with literals, indentation and nested comments, tokenized by the flex
+    scanner and the hand-written one. The two must agree on every token and
+    its location, the throughput of each is reported on stderr
+*/
+static int benchLexer(size_t megabytes) {
+  using clock = std::chrono::steady_clock;
+  using token = MC::MC_Parser::token;
+  const int rounds = 3;
+  std::string source;
+  for (size_t i = 0; source.size() < megabytes << 20; i++) {
+    std::string k = std::to_string(i);
+    source += "(* definition " + k +
+              ", (* nested *) and a comment\n   on two lines *)\n"
+              "let f" + k + " (x : int) (y : float) : string =\n"
+              "    let s = \"literal " + k + " with \\\"escapes\\\"\" in\n"
+              "    concat s (string_of_float (mul_float y " + k +
+              ".25)) (add x " + k + ");;\n\n";
+  }
+
+  // A hash of the tokens, their values and locations
+  auto scan = [](MC::MC_Scanner &scanner, size_t &tokens) {
+    MC::MC_Parser::semantic_type value;
+    MC::MC_Parser::location_type location;
+    uint64_t h = 0xcbf29ce484222325ull;
+    auto mix = [&h](uint64_t v) { h = (h ^ v) * 0x100000001b3ull; };
+    tokens = 0;
+    while (int kind = scanner.yylex(&value, &location)) {
+      tokens++;
+      mix(kind);
+      mix(uint64_t(location.begin.line) << 32 | location.begin.column);
+      mix(uint64_t(location.end.line) << 32 | location.end.column);
+      switch (kind) {
+      case token::INTLIT:
+        mix(value.as<int>());
+        value.destroy<int>();
+        break;
+      case token::FLOATLIT:
+        mix(std::hash<double>()(value.as<double>()));
+        value.destroy<double>();
+        break;
+      case token::STRINGLIT:
+        mix(std::hash<std::string>()(value.as<std::string>()));
+        value.destroy<std::string>();
+        break;
+      case token::ID:
+        mix(value.as<Symbol>().index());
+        value.destroy<Symbol>();
+        break;
+      }
+    }
+    return h;
+  };
+
+  size_t tokens[2];
+  uint64_t hashes[2];
+  double rates[2] = {0, 0};
+  for (int r = 0; r < rounds; r++)
+    for (int fast = 0; fast < 2; fast++) {
+      auto t0 = clock::now();
+      std::unique_ptr<MC::MC_Scanner> scanner;
+      if (fast)
+        scanner = std::make_unique<MC::FastScanner>(source);
+      else
+        scanner = std::make_unique<MC::FlexScanner>(source);
+      hashes[fast] = scan(*scanner, tokens[fast]);
+      std::chrono::duration<double> d = clock::now() - t0;
+      rates[fast] = std::max(rates[fast], source.size() / d.count() / 1e6);
+    }
+  if (hashes[0] != hashes[1] || tokens[0] != tokens[1])
+    throw std::runtime_error("bench-lexer: the scanners disagree");
+  std::cerr << "bench-lexer: " << source.size() / 1000000.0 << " MB, "
+            << tokens[1] << " tokens, flex " << rates[0] << " MB/s, "
+            << "hand-written " << rates[1] << " MB/s" << std::endl;
+  return 0;
+}
+
+/*
+    Parser benchmark: a program of `count` nested definitions of functions
+    of eight arguments, parsed `rounds` times. Time and allocations per
+    definition on stderr
+*/
+static int benchParse(size_t count) {
+  using clock = std::chrono::steady_clock;
+  const int rounds = 10;
+  std::string source;
+  for (size_t i = 0; i < count; i++)
+    source += "let f" + std::to_string(i) +
+              " a b (c : int) (d : int) e f g (h : string) =\n"
+              "  add (add a b) (mul c " + std::to_string(i) + ") in\n";
+  source += "f0 1 2 3 4 5 6 7 \"\"\n";
+
+  Context context;
+  ContextScope scope(context);
+  clock::duration time{};
+  size_t allocated = 0;
+  for (int r = 0; r < rounds; r++) {
+    MC::MC_Driver driver;
+    driver.flex = flexScanner;
+    CountAllocations allocations;
+    auto t0 = clock::now();
+    if (driver.parse(std::string_view(source)))
+      throw std::runtime_error("bench-parse: syntax error");
+    time += clock::now() - t0;
+    allocated += allocations.count;
+  }
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+  std::cerr << "bench-parse: " << ns / (count * rounds) << " ns, "
+            << double(allocated) / (count * rounds)
+            << " allocations per definition" << std::endl;
+  return 0;
+}
+
+/*
+    String benchmark: append `count` two-byte strings with concat, in calls
+    to a function doing `chunk` appends each (the VM has at most 64k locals
+    per function), then print the result. Timings on stderr, the string
+    itself on stdout
+*/
+static int benchConcat(size_t count, Engine engine) {
+  using clock = std::chrono::steady_clock;
+  const size_t chunk = std::min<size_t>(count, 1000);
+  Context context;
+  ContextScope scope(context);
+  Symbol s = Symbol::intern("s"), append = Symbol::intern("append");
+  auto var = [](Symbol name) {
+    return TermNode::VarTerm(name, TermNode::Var::Free, TypeNode::Unknown());
+  };
+  auto concat = [&](Term str) {
+    return TermNode::AppTerm(
+        TermNode::AppTerm(var(Symbol::intern("concat")), var(s)), str);
+  };
+
+  Term body = var(s);
+  for (size_t i = 0; i < chunk; i++)
+    body = TermNode::LetTerm(s, TypeNode::String(),
+                             concat(TermNode::String("ab")), body);
+
+  Term src = TermNode::AppTerm(var(Symbol::intern("print_endline")), var(s));
+  for (size_t i = 0; i < count / chunk; i++)
+    src = TermNode::LetTerm(s, TypeNode::String(),
+                            TermNode::AppTerm(var(append), var(s)), src);
+  src = TermNode::LetTerm(s, TypeNode::String(), TermNode::String(""), src);
+  src = TermNode::LetTerm(append, TypeNode::Unknown(),
+                          TermNode::AbsTerm(s, TypeNode::String(), body), src);
+
+  Term prog = compileTerm(src, context);
+  if (!prog)
+    return 1;
+  auto t0 = clock::now();
+  execute(prog, context, engine);
+  auto ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - t0)
+          .count();
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  size_t appends = count / chunk * chunk;
+  std::cerr << "bench-concat: " << appends << " appends, " << ns / appends
+            << " ns per append including the final print, max rss "
+            << usage.ru_maxrss / 1024 << " MB" << std::endl;
+  return 0;
+}
+
+/*
+    String check: string_sub called as programs call it, curried. A long
+    slice shares the text of its string, ranges past either end fail
+*/
+static int checkStrings(Engine engine) {
+  std::ostringstream diagnostics;
+  Session session(engine, diagnostics);
+  std::map<std::string, std::string_view> text;
+  session.onResult([&](Symbol name, const Val &value) {
+    if (value.kind() == Val::VString)
+      text[name.str()] = std::get<Rope>(value->payload).view();
+  });
+  auto run = [&](const std::string &phrase) {
+    session.submit(phrase);
+    return session.run() == Ok;
+  };
+
+  size_t failed = 0;
+  auto check = [&](bool ok, const std::string &what) {
+    if (!ok) {
+      std::cerr << "check-strings: " << what << std::endl;
+      failed++;
+    }
+  };
+
+  // Slices longer than a short leaf share, shorter ones are copied. The
+  // small-step engine keeps strings in terms, it copies them all
+  std::string letters;
+  for (int i = 0; i < 200; i++)
+    letters += char('a' + i % 26);
+  check(run("let s = \"" + letters + "\""), "let s");
+  check(run("let t = string_sub s 8 100") &&
+            (engine == SmallStep ||
+             text["t"].data() == text["s"].data() + 8) &&
+            text["t"] == letters.substr(8, 100),
+        "string_sub s 8 100 does not share s");
+  check(run("let u = string_sub s 30 4") && text["u"] == "efgh",
+        "string_sub s 30 4");
+  check(run("let whole = string_sub s 0 200") && text["whole"] == letters,
+        "string_sub s 0 200");
+  check(run("let none = string_sub s 200 0") && text["none"].empty(),
+        "string_sub s 200 0");
+  for (const char *range : {"0 201", "201 0", "200 1", "(sub 0 1) 1",
+                            "1 (sub 0 1)", "1 2147483647",
+                            "2147483647 2147483647"}) {
+    diagnostics.str("");
+    check(!run(std::string("string_sub s ") + range) &&
+              diagnostics.str().find("out of bounds") != std::string::npos,
+          std::string("string_sub s ") + range + " is in bounds");
+  }
+
+  std::cerr << "check-strings: " << (failed ? "FAILED" : "ok") << std::endl;
+  return failed != 0;
+}
+
+/*
+    Toplevel: phrases read from stdin, each ended by `;;` or the end of the
+    input, run in one session as they come in. Definitions print
+    `val x = v`, expressions `- = v` unless they return ()
+*/
+static int repl(Engine engine) {
+  Session session(engine);
+  session.heap().config = heapConfig;
+  session.onResult([](Symbol name, const Val &value) {
+    if (!name.isWildcard())
+      std::cout << "val " << name.str() << " = " << stringOfValue(value)
+                << std::endl;
+    else if (value.kind() != Val::VUnit)
+      std::cout << "- = " << stringOfValue(value) << std::endl;
+  });
+
+  bool prompt = isatty(STDIN_FILENO), failed = false;
+  std::string buffer, line;
+  while (true) {
+    if (prompt)
+      std::cout << (buffer.empty() ? "# " : "  ") << std::flush;
+    if (!std::getline(std::cin, line))
+      break;
+    std::string rest;
+    for (auto &phrase : splitPhrases(buffer + line + "\n", &rest))
+      session.submit(phrase);
+    buffer = std::move(rest);
+    failed = session.run() == Error || failed;
+  }
+  for (auto &phrase : splitPhrases(buffer))
+    session.submit(phrase);
+  failed = session.run() == Error || failed;
+  return failed;
+}
+
+/*
+    Toplevel benchmark: `count` phrases `let xK = add xJ 1`, J the phrase
+    before K, then `count` calls of a function defined first, each phrase
+    in the session timed from submit to result. Reported on stderr: the
+    first and last tenth of each run should cost the same
+*/
+static int benchRepl(size_t count, Engine engine) {
+  using clock = std::chrono::steady_clock;
+  std::ostringstream diagnostics;
+  Session session(engine, diagnostics);
+  session.heap().config = heapConfig;
+  auto time = [&](const std::string &phrase) {
+    auto t0 = clock::now();
+    session.submit(phrase);
+    if (session.run() != Ok)
+      throw std::runtime_error("bench-repl: " + phrase + ": " +
+                               diagnostics.str());
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() -
+                                                                t0)
+        .count();
+  };
+
+  time("let twice f x = f (f x)");
+  time("let x0 = 0");
+  size_t tenth = std::max<size_t>(count / 10, 1);
+  uint64_t defineFirst = 0, defineLast = 0, callFirst = 0, callLast = 0;
+  for (size_t i = 1; i <= count; i++) {
+    auto ns = time("let x" + std::to_string(i) + " = add x" +
+                   std::to_string(i - 1) + " 1");
+    if (i <= tenth)
+      defineFirst += ns;
+    if (i > count - tenth)
+      defineLast += ns;
+  }
+  for (size_t i = 1; i <= count; i++) {
+    auto ns = time("twice succ x" + std::to_string(i));
+    if (i <= tenth)
+      callFirst += ns;
+    if (i > count - tenth)
+      callLast += ns;
+  }
+
+  std::cerr << "bench-repl: " << count << " definitions, first tenth "
+            << defineFirst / tenth / 1000 << " us, last tenth "
+            << defineLast / tenth / 1000 << " us per phrase" << std::endl;
+  std::cerr << "bench-repl: " << count << " calls, first tenth "
+            << callFirst / tenth / 1000 << " us, last tenth "
+            << callLast / tenth / 1000 << " us per phrase" << std::endl;
+  return 0;
+}
+
+/*
+    Incremental compile benchmark: a file of `count` definitions
+    `let fK y = add y K` each using the one before, then one line edited
+    in the middle and the file loaded again, at a tenth of `count` phrases
+    and at `count`. The phrases after the edit run again, only the edited
+    one and those depending on it compile again. Reported on stderr
+*/
+static int benchEdit(size_t count, Engine engine) {
+  for (size_t n : {std::max<size_t>(count / 10, 2), count}) {
+    std::ostringstream diagnostics;
+    Session session(engine, diagnostics);
+    session.heap().config = heapConfig;
+    auto source = [n](size_t edited, int k) {
+      std::string src = "let f0 y = y;;\n";
+      for (size_t i = 1; i < n; i++) {
+        // Only the last few use the one before, the edit's dependents
+        std::string prev = i + 4 >= n ? "f" + std::to_string(i - 1) : "succ";
+        src += "let f" + std::to_string(i) + " y = " + prev + " (add y " +
+               std::to_string(i == edited ? k : int(i)) + ");;\n";
+      }
+      return src + "f" + std::to_string(n - 1) + " 0";
+    };
+    auto load = [&](const std::string &src) {
+      Session::Stats before = session.stats();
+      session.load(src);
+      if (session.run() != Ok)
+        throw std::runtime_error("bench-edit: " + diagnostics.str());
+      const Session::Stats &after = session.stats();
+      std::cerr << "bench-edit: " << n << " phrases, compiled "
+                << after.compiled - before.compiled << ", reused "
+                << after.reused - before.reused << ", compile "
+                << after.compileMicros - before.compileMicros << " us"
+                << std::endl;
+    };
+    load(source(0, 0));
+    load(source(n / 2, -1));
+    load(source(n - 3, -1));
+  }
+  return 0;
+}
+
+/*
+    Batch mode
+    ----------
+    Run every .ml file under a directory, or the files a manifest lists (one
+    path per line, relative to the manifest, `#` starts a comment), on the
+    task pool. Each program's output is captured and compared with the
+    `.out` file next to it when there is one, and its input is read from the
+    `.in` file next to it, empty otherwise. Each program is compiled and
+    run in a context of its own, so they run side by side from the parser
+    on. A JSON summary with per-phase timings goes to stdout, or to
+    `report`
+*/
+struct BatchResult {
+  std::string file;
+  const char *status = "ok"; // pass, fail, ok (nothing to compare), error,
+                             // limit
+  std::string output, message;
+  uint64_t parse = 0, compile = 0, load = 0, run = 0; // microseconds
+};
+
+static std::string jsonString(std::string_view s) {
+  std::string out = "\"";
+  for (unsigned char c : s) {
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      if (c < 0x20) {
+        char buf[8];
+        snprintf(buf, sizeof buf, "\\u%04x", c);
+        out += buf;
+      } else {
+        out += c;
+      }
+    }
+  }
+  return out + "\"";
+}
+
+static std::optional<std::string> readFile(const std::filesystem::path &p) {
+  std::ifstream in(p, std::ios::binary);
+  if (!in)
+    return std::nullopt;
+  std::ostringstream text;
+  text << in.rdbuf();
+  return text.str();
+}
+
+static std::vector<std::string> batchFiles(const std::string &source) {
+  namespace fs = std::filesystem;
+  std::vector<std::string> files;
+  if (fs::is_directory(source)) {
+    for (auto &entry : fs::recursive_directory_iterator(source))
+      if (entry.is_regular_file() && entry.path().extension() == ".ml")
+        files.push_back(entry.path().string());
+    std::sort(files.begin(), files.end());
+    return files;
+  }
+
+  std::ifstream manifest(source);
+  if (!manifest)
+    throw std::runtime_error("batch: cannot read " + source);
+  fs::path dir = fs::path(source).parent_path();
+  std::string line;
+  while (std::getline(manifest, line)) {
+    line = line.substr(0, line.find('#'));
+    size_t begin = line.find_first_not_of(" \t\r");
+    if (begin == std::string::npos)
+      continue;
+    size_t end = line.find_last_not_of(" \t\r");
+    files.push_back((dir / line.substr(begin, end - begin + 1)).string());
+  }
+  return files;
+}
+
+static void runBatchProgram(BatchResult &r, Engine engine, Fuel fuel) {
+  using clock = std::chrono::steady_clock;
+  auto since = [](clock::time_point t0) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(clock::now() -
+                                                                 t0)
+        .count();
+  };
+  std::filesystem::path stem = r.file;
+  std::optional<std::string> expected =
+      readFile(std::filesystem::path(stem).replace_extension(".out"));
+  std::istringstream input(
+      readFile(std::filesystem::path(stem).replace_extension(".in"))
+          .value_or(""));
+
+  // Diagnostics, and dumps in debug builds, are kept with the program
+  std::ostringstream diagnostics;
+  Context context(diagnostics);
+  Term prog;
+  {
+    ContextScope scope(context);
+    auto t0 = clock::now();
+    MC::MC_Driver driver;
+    driver.flex = flexScanner;
+    driver.errors = &diagnostics;
+    bool failed = driver.parse(r.file.c_str());
+    r.parse = since(t0);
+    if (!failed) {
+      t0 = clock::now();
+      prog = compileTerm(std::move(driver.root_term), context);
+      r.compile = since(t0);
+    }
+  }
+  if (!prog) {
+    r.status = "error";
+    r.message = diagnostics.str();
+    return;
+  }
+
+  Execution exec(std::move(prog), context, engine);
+  exec.heap().config = heapConfig;
+  exec.reportErrors(false);
+  exec.output().capture = &r.output;
+  auto t0 = clock::now();
+  exec.prepare();
+  r.load = since(t0);
+
+  ReturnCode code = Error;
+  if (!exec.finished()) {
+    std::istream *in = currentIn;
+    currentIn = &input;
+    t0 = clock::now();
+    code = exec.run(fuel);
+    r.run = since(t0);
+    currentIn = in;
+  }
+
+  switch (code) {
+  case Ok:
+    r.status = !expected ? "ok" : r.output == *expected ? "pass" : "fail";
+    break;
+  case OutOfFuel:
+    r.status = "limit";
+    r.message = fuel.micros && r.run >= fuel.micros
+                    ? "time limit of " + std::to_string(fuel.micros / 1000) +
+                          " ms"
+                    : "step limit of " + std::to_string(fuel.steps);
+    break;
+  case Error:
+    r.status = "error";
+    r.message = exec.error();
+    break;
+  }
+}
+
+struct BatchTask : TaskPool::Task {
+  BatchResult result;
+  Engine engine;
+  Fuel fuel;
+
+  void run() noexcept override {
+    try {
+      runBatchProgram(result, engine, fuel);
+    } catch (const std::exception &e) {
+      result.status = "error";
+      result.message = e.what();
+    }
+  }
+};
+
+static int batch(const std::string &source, Engine engine, Fuel fuel,
+                 const std::string &report) {
+  using clock = std::chrono::steady_clock;
+  auto t0 = clock::now();
+  std::vector<std::unique_ptr<BatchTask>> tasks;
+  for (auto &file : batchFiles(source)) {
+    tasks.push_back(std::make_unique<BatchTask>());
+    tasks.back()->result.file = file;
+    tasks.back()->engine = engine;
+    tasks.back()->fuel = fuel;
+  }
+  TaskPool &pool = TaskPool::shared();
+  for (auto &task : tasks)
+    pool.spawn(*task);
+  for (auto &task : tasks)
+    pool.join(*task);
+  auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                    clock::now() - t0)
+                    .count();
+
+  std::map<std::string, size_t> counts;
+  uint64_t parse = 0, compile = 0, load = 0, run = 0;
+  for (auto &task : tasks) {
+    auto &r = task->result;
+    counts[r.status]++;
+    parse += r.parse;
+    compile += r.compile;
+    load += r.load;
+    run += r.run;
+  }
+
+  const char *engines[] = {"step", "cek", "vm"};
+  std::ostringstream json;
+  json << "{\n  \"engine\": \"" << engines[engine] << "\",\n"
+       << "  \"threads\": " << pool.workers() + 1 << ",\n"
+       << "  \"programs\": " << tasks.size() << ",\n";
+  for (const char *status : {"pass", "fail", "ok", "error", "limit"})
+    json << "  \"" << status << "\": " << counts[status] << ",\n";
+  json << "  \"micros\": " << micros << ",\n"
+       << "  \"phases\": {\"parse\": " << parse << ", \"compile\": " << compile
+       << ", \"load\": " << load << ", \"run\": " << run << "},\n"
+       << "  \"results\": [";
+  for (size_t i = 0; i < tasks.size(); i++) {
+    auto &r = tasks[i]->result;
+    json << (i ? ",\n" : "\n") << "    {\"file\": " << jsonString(r.file)
+         << ", \"status\": \"" << r.status << "\", \"parse\": " << r.parse
+         << ", \"compile\": " << r.compile << ", \"load\": " << r.load
+         << ", \"run\": " << r.run;
+    if (!r.message.empty())
+      json << ", \"message\": " << jsonString(r.message);
+    // Passing output is the expected file already
+    if (strcmp(r.status, "pass"))
+      json << ", \"output\": " << jsonString(r.output);
+    json << "}";
+  }
+  json << "\n  ]\n}\n";
+
+  if (report.empty()) {
+    std::cout << json.str();
+  } else {
+    std::ofstream out(report);
+    out << json.str();
+    if (!out)
+      throw std::runtime_error("batch: cannot write " + report);
+  }
+  return counts["fail"] || counts["error"] || counts["limit"];
+}
+
+/*
+    Images
+    ------
+    `--emit-image` compiles a file's phrases into its image, where the 3DS
+    frontend looks for it. `--image` runs the file as the frontend does, in
+    a session primed from its image when that is fresh, and reports on
+    stderr what it took before the first phrase ran
+*/
+static int emitImage(const std::string &filename) {
+  std::optional<std::string> source = readFile(filename);
+  if (!source) {
+    std::cerr << "emit-image: cannot read " << filename << std::endl;
+    return 1;
+  }
+  Session session;
+  if (!session.saveImage(*source, imagePath(filename))) {
+    std::cerr << "emit-image: " << imagePath(filename) << " not written"
+              << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+static int runImage(const std::string &filename, Engine engine) {
+  using clock = std::chrono::steady_clock;
+  std::optional<std::string> source = readFile(filename);
+  if (!source) {
+    std::cerr << "image: cannot read " << filename << std::endl;
+    return 1;
+  }
+  Session session(engine);
+  session.heap().config = heapConfig;
+  auto t0 = clock::now();
+  bool fresh = session.loadImage(*source, imagePath(filename));
+  auto read = std::chrono::duration_cast<std::chrono::microseconds>(
+                  clock::now() - t0)
+                  .count();
+  session.load(*source);
+  ReturnCode code = session.run();
+  const Session::Stats &stats = session.stats();
+  std::cerr << "image: " << (fresh ? "read" : "none or stale") << " in "
+            << read << " us, compiled " << stats.compiled << " phrases in "
+            << stats.compileMicros << " us, reused " << stats.reused
+            << std::endl;
+  return code != Ok;
 }
 
 int main(int argc, char **argv) {
-  if (argc < 2) {
-    std::cerr << "Usage: devel <filename>\n";
+  Engine engine = CEK;
+  bool disasm = false;
+  size_t stressCount = 0;
+  size_t benchCount = 0;
+  size_t passesCount = 0;
+  size_t concatCount = 0;
+  size_t replCount = 0;
+  size_t editCount = 0;
+  size_t lexerMegabytes = 0;
+  size_t parseCount = 0;
+  bool interactive = false, emit = false, image = false, strings = false;
+  size_t fuel = 0;
+  Fuel limits;
+  std::string filename, batchSource, report;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--step")) {
+      engine = SmallStep;
+    } else if (!strcmp(argv[i], "--cek")) {
+      engine = CEK;
+    } else if (!strcmp(argv[i], "--vm")) {
+      engine = Bytecode;
+    } else if (!strcmp(argv[i], "--disasm")) {
+      disasm = true;
+    } else if (!strcmp(argv[i], "--heap") && i + 1 < argc) {
+      heapConfig.limit = std::stoul(argv[++i]) << 10;
+    } else if (!strcmp(argv[i], "--nursery") && i + 1 < argc) {
+      heapConfig.nursery = std::stoul(argv[++i]) << 10;
+    } else if (!strcmp(argv[i], "--gc-stats")) {
+      gcStats = true;
+    } else if (!strcmp(argv[i], "--flex")) {
+      flexScanner = true;
+    } else if (!strcmp(argv[i], "--jobs") && i + 1 < argc) {
+      TaskPool::configure(std::max(std::stoul(argv[++i]), 1ul) - 1);
+    } else if (!strcmp(argv[i], "--fuel") && i + 1 < argc) {
+      fuel = std::stoul(argv[++i]);
+    } else if (!strcmp(argv[i], "--batch") && i + 1 < argc) {
+      batchSource = argv[++i];
+    } else if (!strcmp(argv[i], "--report") && i + 1 < argc) {
+      report = argv[++i];
+    } else if (!strcmp(argv[i], "--max-steps") && i + 1 < argc) {
+      limits.steps = std::stoul(argv[++i]);
+    } else if (!strcmp(argv[i], "--max-ms") && i + 1 < argc) {
+      limits.micros = std::stoul(argv[++i]) * 1000;
+    } else if (!strcmp(argv[i], "--bench-print")) {
+      benchCount = i + 1 < argc && isdigit(*argv[i + 1])
+                       ? std::stoul(argv[++i])
+                       : 100000;
+    } else if (!strcmp(argv[i], "--bench-passes")) {
+      passesCount = i + 1 < argc && isdigit(*argv[i + 1])
+                        ? std::stoul(argv[++i])
+                        : 10000;
+    } else if (!strcmp(argv[i], "--bench-lexer")) {
+      lexerMegabytes = i + 1 < argc && isdigit(*argv[i + 1])
+                           ? std::stoul(argv[++i])
+                           : 8;
+    } else if (!strcmp(argv[i], "--bench-parse")) {
+      parseCount = i + 1 < argc && isdigit(*argv[i + 1])
+                       ? std::stoul(argv[++i])
+                       : 10000;
+    } else if (!strcmp(argv[i], "--bench-concat")) {
+      concatCount = i + 1 < argc && isdigit(*argv[i + 1])
+                        ? std::stoul(argv[++i])
+                        : 100000;
+    } else if (!strcmp(argv[i], "--check-strings")) {
+      strings = true;
+    } else if (!strcmp(argv[i], "--emit-image")) {
+      emit = true;
+    } else if (!strcmp(argv[i], "--image")) {
+      image = true;
+    } else if (!strcmp(argv[i], "--repl")) {
+      interactive = true;
+    } else if (!strcmp(argv[i], "--bench-repl")) {
+      replCount = i + 1 < argc && isdigit(*argv[i + 1])
+                      ? std::stoul(argv[++i])
+                      : 1000;
+    } else if (!strcmp(argv[i], "--bench-edit")) {
+      editCount = i + 1 < argc && isdigit(*argv[i + 1])
+                      ? std::stoul(argv[++i])
+                      : 1000;
+    } else if (!strcmp(argv[i], "--stress")) {
+      stressCount = i + 1 < argc && isdigit(*argv[i + 1])
+                        ? std::stoul(argv[++i])
+                        : 1000000;
+    } else {
+      filename = argv[i];
+    }
+  }
+
+  if (stressCount)
+    return stress(stressCount, engine);
+  if (benchCount)
+    return benchPrint(benchCount, engine);
+  if (passesCount)
+    return benchPasses(passesCount);
+  if (concatCount)
+    return benchConcat(concatCount, engine);
+  if (strings)
+    return checkStrings(engine);
+  if (lexerMegabytes)
+    return benchLexer(lexerMegabytes);
+  if (parseCount)
+    return benchParse(parseCount);
+  if (replCount)
+    return benchRepl(replCount, engine);
+  if (editCount)
+    return benchEdit(editCount, engine);
+  if (!batchSource.empty())
+    return batch(batchSource, engine, limits, report);
+  if (interactive)
+    return repl(engine);
+
+  if (filename.empty()) {
+    std::cerr << "Usage: devel [--step | --cek | --vm] [--disasm] "
+                 "[--fuel steps] <filename>\n"
+              << "       devel [--step | --cek | --vm] --stress [count]\n"
+              << "       devel [--step | --cek | --vm] --bench-print [count]\n"
+              << "       devel [--step | --cek | --vm] --bench-concat [count]\n"
+              << "       devel [--step | --cek | --vm] --bench-repl [count]\n"
+              << "       devel [--step | --cek | --vm] --bench-edit [count]\n"
+              << "       devel [--step | --cek | --vm] --check-strings\n"
+              << "       devel --bench-passes [count]\n"
+              << "       devel --bench-lexer [megabytes]\n"
+              << "       devel [--flex] --bench-parse [count]\n"
+              << "       devel [--step | --cek | --vm] [--flex] --batch "
+                 "dir|manifest [--max-steps n] [--max-ms n] [--report file]\n"
+              << "       devel [--step | --cek | --vm] --repl, phrases "
+                 "ending in ;; on stdin\n"
+              << "       devel --emit-image <filename>, compiled to "
+                 "<filename>.img\n"
+              << "       devel [--step | --cek | --vm] --image <filename>, "
+                 "run from its image\n"
+              << "Heap: [--heap limit_kb] [--nursery size_kb, 0 for none] "
+                 "[--gc-stats]\n"
+              << "VM: [--jobs threads, 1 for no forking]\n";
     return 1;
   }
 
-  std::string filename = argv[1];
-  interpreterMain(filename);
+  if (emit)
+    return emitImage(filename);
+  if (image)
+    return runImage(filename, engine);
+
+  Context context;
+  if (disasm) {
+    Term prog = compileFile(filename, context);
+    if (!prog)
+      return 1;
+    std::cout << disassemble(compileBytecode(
+        prog, TaskPool::shared().workers() ? FORK_COST : 0));
+    return 0;
+  }
 
+  // With fuel, resume in slices of `fuel` steps as the 3DS frontend does
+  // per frame
+  Term prog = compileFile(filename, context);
+  if (!prog)
+    return 1;
+  execute(prog, context, engine, fuel);
   return 0;
 }
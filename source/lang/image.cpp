@@ -0,0 +1,400 @@
+#include "image.h"
+#include "context.h"
+#include "stdlib/stdlib.h"
+#include <cstring>
+#include <stdexcept>
+
+static const char MAGIC[4] = {'S', 'M', 'L', 'I'};
+
+uint64_t hashSource(const std::string &text) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (unsigned char c : text)
+    h = (h ^ c) * 0x100000001b3ull;
+  return h;
+}
+
+// Signed integers as varints, small magnitudes short
+static uint64_t zigzag(int i) {
+  return (uint32_t(i) << 1) ^ uint32_t(i >> 31);
+}
+
+static int unzigzag(uint64_t v) {
+  return int(uint32_t(v >> 1) ^ -uint32_t(v & 1));
+}
+
+static void putU64(std::string &out, uint64_t v) {
+  for (int i = 0; i < 8; i++)
+    out.push_back(char(v >> (8 * i)));
+}
+
+/*
+    Writing
+    -------
+*/
+void ImageWriter::putVarint(std::string &out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(char(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back(char(v));
+}
+
+void ImageWriter::u64(uint64_t v) { putU64(body, v); }
+
+uint64_t ImageWriter::symbolRef(Symbol s) {
+  if (s.isWildcard())
+    return 0;
+  auto [it, added] = symbolIndex.emplace(s.index(), symbolCount + 1);
+  if (added) {
+    putVarint(symbols, s.str().size());
+    symbols += s.str();
+    symbolCount++;
+  }
+  return it->second;
+}
+
+uint64_t ImageWriter::typeRef(Type t) {
+  // Bound variables are stored as what they stand for
+  while (t && t->kind == TypeNode::TVar) {
+    auto &var = std::get<TypeNode::TypeVar>(t->payload);
+    if (!var.stored)
+      break;
+    t = *var.stored;
+  }
+  if (!t)
+    return 0;
+  auto found = typeIndex.find(t.get());
+  if (found != typeIndex.end())
+    return found->second;
+
+  // Types are shallow, children are written first by recursion
+  uint64_t left = 0, right = 0;
+  if (t->kind == TypeNode::TTuple) {
+    auto &tuple = std::get<TypeNode::Tuple>(t->payload);
+    left = typeRef(tuple.left);
+    right = typeRef(tuple.right);
+  } else if (t->kind == TypeNode::TArrow) {
+    auto &arrow = std::get<TypeNode::Arrow>(t->payload);
+    left = typeRef(arrow.param);
+    right = typeRef(arrow.result);
+  }
+  types.push_back(char(t->kind));
+  if (t->kind == TypeNode::TTuple || t->kind == TypeNode::TArrow) {
+    putVarint(types, left);
+    putVarint(types, right);
+  }
+  return typeIndex[t.get()] = ++typeCount;
+}
+
+uint64_t ImageWriter::termRef(const Term &root) {
+  // Terms can be as deep as the program is long: walk them in postorder
+  // with a stack of our own
+  std::vector<std::pair<const TermNode *, bool>> stack{{root.get(), false}};
+  while (!stack.empty()) {
+    auto [node, expanded] = stack.back();
+    if (termIndex.count(node)) {
+      stack.pop_back();
+      continue;
+    }
+
+    const TermNode *children[2] = {nullptr, nullptr};
+    switch (node->kind) {
+    case TermNode::TmTuple: {
+      auto &tuple = std::get<TermNode::Tuple>(node->payload);
+      children[0] = tuple.left.get();
+      children[1] = tuple.right.get();
+      break;
+    }
+    case TermNode::TmLet: {
+      auto &let = std::get<TermNode::Let>(node->payload);
+      children[0] = let.e1.get();
+      children[1] = let.e2.get();
+      break;
+    }
+    case TermNode::TmAbs:
+      children[0] = std::get<TermNode::Abs>(node->payload).body.get();
+      break;
+    case TermNode::TmApp: {
+      auto &app = std::get<TermNode::App>(node->payload);
+      children[0] = app.f.get();
+      children[1] = app.arg.get();
+      break;
+    }
+    default:
+      break;
+    }
+    if (!expanded) {
+      stack.back().second = true;
+      for (const TermNode *child : children)
+        if (child && !termIndex.count(child))
+          stack.push_back({child, false});
+      continue;
+    }
+    stack.pop_back();
+
+    terms.push_back(char(node->kind));
+    putVarint(terms, typeRef(node->type));
+    for (const TermNode *child : children)
+      if (child)
+        putVarint(terms, termIndex.at(child));
+    switch (node->kind) {
+    case TermNode::TmBool:
+      terms.push_back(char(std::get<bool>(node->payload)));
+      break;
+    case TermNode::TmInt:
+      putVarint(terms, zigzag(std::get<int>(node->payload)));
+      break;
+    case TermNode::TmFloat: {
+      uint64_t bits;
+      double f = std::get<double>(node->payload);
+      memcpy(&bits, &f, sizeof bits);
+      putU64(terms, bits);
+      break;
+    }
+    case TermNode::TmString: {
+      auto &s = std::get<std::string>(node->payload);
+      putVarint(terms, s.size());
+      terms += s;
+      break;
+    }
+    case TermNode::TmLet: {
+      auto &let = std::get<TermNode::Let>(node->payload);
+      putVarint(terms, symbolRef(let.name));
+      putVarint(terms, typeRef(let.type));
+      break;
+    }
+    case TermNode::TmAbs: {
+      auto &abs = std::get<TermNode::Abs>(node->payload);
+      putVarint(terms, symbolRef(abs.param));
+      putVarint(terms, typeRef(abs.paramType));
+      break;
+    }
+    case TermNode::TmVar: {
+      auto &var = std::get<TermNode::Var>(node->payload);
+      putVarint(terms, symbolRef(var.name));
+      putVarint(terms, zigzag(var.index));
+      break;
+    }
+    case TermNode::TmPrim:
+      putVarint(terms, symbolRef(std::get<TermNode::Prim>(node->payload).name));
+      break;
+    default:
+      break;
+    }
+    termIndex[node] = termCount++;
+  }
+  return termIndex.at(root.get());
+}
+
+std::string ImageWriter::finish(uint64_t source) const {
+  std::string out(MAGIC, sizeof MAGIC);
+  for (int i = 0; i < 4; i++)
+    out.push_back(char(IMAGE_VERSION >> (8 * i)));
+  putU64(out, source);
+  putVarint(out, symbolCount);
+  out += symbols;
+  putVarint(out, typeCount);
+  out += types;
+  putVarint(out, termCount);
+  out += terms;
+  return out + body;
+}
+
+/*
+    Reading
+    -------
+*/
+ImageReader::ImageReader(const uint8_t *data, size_t size)
+    : at(data), end(data + size) {
+  if (size < 16 || memcmp(data, MAGIC, sizeof MAGIC))
+    return;
+  uint32_t version = 0;
+  for (int i = 0; i < 4; i++)
+    version |= uint32_t(data[4 + i]) << (8 * i);
+  if (version != IMAGE_VERSION)
+    return;
+  at += 8;
+  sourceHash = u64();
+}
+
+uint8_t ImageReader::byte() {
+  if (at == end)
+    throw std::runtime_error("image: truncated");
+  return *at++;
+}
+
+uint64_t ImageReader::varint() {
+  uint64_t v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    uint8_t b = byte();
+    v |= uint64_t(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return v;
+  }
+  throw std::runtime_error("image: bad integer");
+}
+
+uint64_t ImageReader::u64() {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++)
+    v |= uint64_t(byte()) << (8 * i);
+  return v;
+}
+
+std::string ImageReader::bytes(size_t length) {
+  if (length > size_t(end - at))
+    throw std::runtime_error("image: truncated");
+  std::string s(reinterpret_cast<const char *>(at), length);
+  at += length;
+  return s;
+}
+
+Symbol ImageReader::symbolAt(uint64_t ref) const {
+  if (ref == 0)
+    return Symbol();
+  if (ref > symbols.size())
+    throw std::runtime_error("image: bad symbol");
+  return symbols[ref - 1];
+}
+
+Type ImageReader::typeAt(uint64_t ref) const {
+  if (ref == 0)
+    return nullptr;
+  if (ref > types.size())
+    throw std::runtime_error("image: bad type");
+  return types[ref - 1];
+}
+
+Term ImageReader::termAt(uint64_t index) const {
+  if (index >= terms.size())
+    throw std::runtime_error("image: bad term");
+  return terms[index];
+}
+
+Symbol ImageReader::symbol() { return symbolAt(varint()); }
+Type ImageReader::type() { return typeAt(varint()); }
+Term ImageReader::term() { return termAt(varint()); }
+
+void ImageReader::readTables() {
+  // Every record takes a byte at least, larger counts are corrupt
+  auto count = [&] {
+    uint64_t n = varint();
+    if (n > uint64_t(end - at))
+      throw std::runtime_error("image: truncated");
+    return size_t(n);
+  };
+
+  symbols.resize(count());
+  for (Symbol &s : symbols)
+    s = Symbol::intern(bytes(varint()));
+
+  // Primitives are those of the context the program is read into, as
+  // compiling its source there would bind them
+  const PrimitiveTable &prims =
+      currentContext ? currentContext->primitives() : primitives;
+
+  size_t n = count();
+  types.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    auto kind = TypeNode::Kind(byte());
+    switch (kind) {
+    case TypeNode::TUnknown:
+      types.push_back(TypeNode::Unknown());
+      break;
+    case TypeNode::TUnit:
+    case TypeNode::TBool:
+    case TypeNode::TInt:
+    case TypeNode::TFloat:
+    case TypeNode::TString:
+      types.push_back(TypeNode::base(kind));
+      break;
+    case TypeNode::TTuple:
+    case TypeNode::TArrow: {
+      Type left = type(), right = type();
+      types.push_back(kind == TypeNode::TTuple
+                          ? TypeNode::TupleType(left, right)
+                          : TypeNode::ArrowType(left, right));
+      break;
+    }
+    case TypeNode::TVar:
+      types.push_back(TypeNode::gentyp());
+      break;
+    default:
+      throw std::runtime_error("image: bad type");
+    }
+  }
+
+  n = count();
+  terms.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    auto kind = TermNode::Kind(byte());
+    Type t = type();
+    Term node;
+    switch (kind) {
+    // Constants come from the factories, which share the singletons
+    case TermNode::TmUnit:
+      node = TermNode::Unit();
+      break;
+    case TermNode::TmBool:
+      node = TermNode::Bool(byte());
+      break;
+    case TermNode::TmInt:
+      node = TermNode::Int(unzigzag(varint()));
+      break;
+    case TermNode::TmFloat: {
+      uint64_t bits = u64();
+      double f;
+      memcpy(&f, &bits, sizeof f);
+      node = TermNode::Float(f);
+      break;
+    }
+    case TermNode::TmString:
+      node = TermNode::String(bytes(varint()));
+      break;
+    case TermNode::TmTuple: {
+      Term left = term(), right = term();
+      node = TermNode::intern({kind, TermNode::Tuple{left, right}, t});
+      break;
+    }
+    case TermNode::TmLet: {
+      Term e1 = term(), e2 = term();
+      Symbol name = symbol();
+      Type type = this->type();
+      node = TermNode::intern({kind, TermNode::Let{name, type, e1, e2}, t});
+      break;
+    }
+    case TermNode::TmAbs: {
+      Term body = term();
+      Symbol param = symbol();
+      Type paramType = type();
+      node =
+          TermNode::intern({kind, TermNode::Abs{param, paramType, body}, t});
+      break;
+    }
+    case TermNode::TmApp: {
+      Term f = term(), arg = term();
+      node = TermNode::intern({kind, TermNode::App{f, arg}, t});
+      break;
+    }
+    case TermNode::TmVar: {
+      Symbol name = symbol();
+      int index = unzigzag(varint());
+      node = TermNode::intern({kind, TermNode::Var{name, index}, t});
+      break;
+    }
+    case TermNode::TmPrim: {
+      Symbol name = symbol();
+      auto prim = prims.find(name);
+      if (prim == prims.end())
+        throw std::runtime_error("image: unknown primitive " + name.str());
+      node = TermNode::intern({kind, TermNode::Prim{name, prim->second}, t});
+      break;
+    }
+    default:
+      throw std::runtime_error("image: bad term");
+    }
+    if (node->type.get() != t.get())
+      node = TermNode::intern({kind, node->payload, t});
+    terms.push_back(node);
+  }
+}
@@ -0,0 +1,98 @@
+#ifndef IMAGE
+#define IMAGE
+
+#include "syntax.h"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+    Program images
+    --------------
+    Compiled programs saved to a file, so opening one again skips parsing,
+    typechecking and reduce(). An image is
+
+        "SMLI" version:u32 source:u64
+        symbols  count, then each as length and bytes
+        types    count, then each as kind and children
+        terms    count, then each as kind, type and payload
+        body     what the writer put there, e.g. a session's phrases
+
+    Integers are little-endian, counts, indices and lengths LEB128 varints.
+    Nodes are stored once and referred to by index, children before their
+    parents, so a program is rebuilt as the DAG it was with one pass and no
+    recursion. Type and symbol references are offset by one, 0 is a null
+    type and the wildcard. Primitives are stored by name and looked up in
+    the table of the context the image is read into.
+
+    `source` is a hash of the text the image was compiled from: an image of
+    another text, or of another IMAGE_VERSION, is not read
+*/
+#define IMAGE_VERSION 1
+
+// Where the image of the program at `path` is kept, next to it
+inline std::string imagePath(const std::string &path) { return path + ".img"; }
+
+// FNV-1a, the hash images are checked against
+uint64_t hashSource(const std::string &text);
+
+class ImageWriter {
+public:
+  // Append to the body
+  void byte(uint8_t b) { body.push_back(char(b)); }
+  void varint(uint64_t v) { putVarint(body, v); }
+  void u64(uint64_t v);
+  void symbol(Symbol s) { varint(symbolRef(s)); }
+  void type(const Type &t) { varint(typeRef(t)); }
+  void term(const Term &t) { varint(termRef(t)); }
+
+  // The whole image of `source`
+  std::string finish(uint64_t source) const;
+
+private:
+  static void putVarint(std::string &out, uint64_t v);
+  uint64_t symbolRef(Symbol s);
+  uint64_t typeRef(Type t);
+  uint64_t termRef(const Term &t);
+
+  std::string symbols, types, terms, body;
+  size_t symbolCount = 0, typeCount = 0, termCount = 0;
+  std::unordered_map<uint32_t, uint64_t> symbolIndex;
+  std::unordered_map<const TypeNode *, uint64_t> typeIndex;
+  std::unordered_map<const TermNode *, uint64_t> termIndex;
+};
+
+// Reads an image from memory, throws std::runtime_error if it is malformed.
+// Nodes are built in the context installed on the calling thread
+class ImageReader {
+public:
+  ImageReader(const uint8_t *data, size_t size);
+
+  // Hash of the source the image was compiled from, 0 if the data is not
+  // an image of this version; only then are the tables read
+  uint64_t source() const { return sourceHash; }
+  void readTables();
+
+  // Read from the body
+  uint8_t byte();
+  uint64_t varint();
+  uint64_t u64();
+  Symbol symbol();
+  Type type();
+  Term term();
+
+private:
+  std::string bytes(size_t length);
+  Symbol symbolAt(uint64_t ref) const;
+  Type typeAt(uint64_t ref) const;
+  Term termAt(uint64_t index) const;
+
+  const uint8_t *at, *end;
+  uint64_t sourceHash = 0;
+  std::vector<Symbol> symbols;
+  std::vector<Type> types;
+  std::vector<Term> terms;
+};
+
+#endif /* IMAGE */
@@ -1,6 +1,11 @@
 #include "interpreter.h"
 #include "parser/driver.hpp"
+#include "runtime/bytecode.h"
+#include "runtime/cek.h"
+#include "runtime/pool.h"
 #include "syntax.h"
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <optional>
@@ -14,8 +19,8 @@ bool isValue(Term term) {
   }
 }
 
-std::optional<std::pair<Term, State>> step(const Term &program,
-                                           const State &state) {
+// One small step of `program`, the context is updated in place
+std::optional<Term> step(const Term &program, State &state) {
 
   switch (program->kind) {
 
@@ -28,26 +33,20 @@ std::optional<std::pair<Term, State>> step(const Term &program,
        Step function position
        ---------------------------------------- */
     if (!isValue(fun)) {
-      auto r = step(fun, state);
-      if (!r)
+      auto fun2 = step(fun, state);
+      if (!fun2)
         return std::nullopt;
-
-      auto &[fun2, state2] = *r;
-      Term newProgram = TermNode::AppTerm(fun2, arg);
-      return std::make_optional(std::make_pair(newProgram, state2));
+      return TermNode::AppTerm(*fun2, arg);
     }
 
     /* ----------------------------------------
        Step argument position
        ---------------------------------------- */
     if (!isValue(arg)) {
-      auto r = step(arg, state);
-      if (!r)
+      auto arg2 = step(arg, state);
+      if (!arg2)
         return std::nullopt;
-
-      auto &[arg2, state2] = *r;
-      Term newProgram = TermNode::AppTerm(fun, arg2);
-      return std::make_optional(std::make_pair(newProgram, state2));
+      return TermNode::AppTerm(fun, *arg2);
     }
 
     /* ----------------------------------------
@@ -55,21 +54,16 @@ std::optional<std::pair<Term, State>> step(const Term &program,
        ---------------------------------------- */
 
     // Case 1: primitive function
-    if (fun->kind == TermNode::TmVar && isPrimitive(fun)) {
-      auto &v = std::get<TermNode::Var>(fun->payload);
-      auto prim = primitives.find(v.name);
-
-      if (prim != primitives.end()) {
-        Term newTerm = prim->second.f(arg); // pure
-        return std::make_optional(std::make_pair(newTerm, state));
-      }
+    if (fun->kind == TermNode::TmPrim) {
+      const Primitive *prim = std::get<TermNode::Prim>(fun->payload).prim;
+      return reify(prim->f(reflect(arg))); // pure
     }
 
     // Case 2: lambda application:  (fun x -> body) arg -> body[x := arg]
     if (fun->kind == TermNode::TmAbs) {
       const auto &abs = std::get<TermNode::Abs>(fun->payload);
-      Term newTerm = substitute(abs.body, abs.param, arg);
-      return std::make_optional(std::make_pair(newTerm, state));
+      return abs.param.isWildcard() ? abs.body
+                                    : substitute(abs.body, abs.param, arg);
     }
 
     return std::nullopt;
@@ -85,64 +79,282 @@ std::optional<std::pair<Term, State>> step(const Term &program,
 #endif
 
 #ifdef __3DS__
-#define ERR(msg) status_message(msg);
+#define ERR(out, msg) status_message(msg);
 #else
-#define ERR(msg) std::cerr << e.what() << std::endl;
+#define ERR(out, msg) out << msg << std::endl;
 #endif
 
-void interpreterMain(std::string filename) {
+// Programs larger than this are not dumped in debug builds
+#define DUMP_LIMIT 10000
+
+#ifdef __DEBUG__
+static void dumpTerm(std::ostream &out, const char *label, Term prog) {
+  if (termLargerThan(prog, DUMP_LIMIT))
+    out << label << " <" << DUMP_LIMIT << "+ nodes>" << std::endl;
+  else
+    out << label << "\n" << stringOfTerm(prog) << std::endl;
+}
+#endif
+
+Term compileTerm(Term parsed, Context &context) {
+  // Every pass allocates from the context's arena. Each phase drops the
+  // previous tree before the next one runs, so its nodes are reused rather
+  // than piling up
+  ContextScope scope(context);
+  Term prog = primitiveArgs(std::move(parsed), context.primitives());
+  prog = resolve(prog, context.primitives());
+
+  DEBUG(dumpTerm(context.diagnostics(), "PARSED:", prog));
+
+  try {
+    prog = typecheck(prog, context);
+  } catch (TypeError &e) {
+
+    ERR(context.diagnostics(), e.what());
+    return nullptr;
+  }
+
+  DO_3DS(status_message("Reducing..."));
+  // assoc() re-nests binders, so indices are recomputed afterwards
+  prog = resolve(reduce(std::move(prog), context), context.primitives());
+
+  DEBUG(dumpTerm(context.diagnostics(), "REDUCED:", prog));
+  return prog;
+}
+
+Term compileFile(std::string filename, Context &context) {
   DO_3DS(status_message("Parsing..."); consoleSelect(&topScreen));
+  ContextScope scope(context);
   MC::MC_Driver driver;
+  driver.errors = &context.diagnostics();
   if (driver.parse(filename.c_str())) {
-    return;
+    return nullptr;
   }
-  Term prog = primitiveArgs(driver.root_term);
+  return compileTerm(std::move(driver.root_term), context);
+}
 
-  DEBUG(std::cout << "PARSED:\n" << stringOfTerm(prog) << std::endl);
+// Steps between clock reads when run() has a time budget
+#define CLOCK_SLICE 256
 
-  try {
-    prog = typecheck(prog);
-  } catch (TypeError &e) {
+// The substitution engine keeps no values between steps
+struct NoRoots : GcRoots {
+  void trace(Heap &) const override {}
+};
+
+struct Execution::Machine {
+  Engine engine;
+  Term prog;                     // SmallStep
+  std::optional<CEKMachine> cek; // CEK
+  std::optional<VM> vm;          // Bytecode
 
-    ERR(e.what());
-    return;
+  // The value of a halted machine. Functions the substitution engine
+  // returns are closed, so they become closures of no environment. Nil if
+  // it got stuck on a term that is no value
+  Val result() const {
+    switch (engine) {
+    case SmallStep:
+      if (prog->kind == TermNode::TmAbs)
+        return Value::ClosureValue(prog, nullptr);
+      if (prog->kind == TermNode::TmPrim)
+        return Value::PrimitiveValue(
+            std::get<TermNode::Prim>(prog->payload).prim);
+      try {
+        return reflect(prog);
+      } catch (const std::runtime_error &) {
+        return Val();
+      }
+    case CEK:
+      return cek->result();
+    case Bytecode:
+      return vm->result();
+    }
+    return Val();
   }
 
-  DO_3DS(status_message("Reducing..."));
-  prog = reduce(prog);
-
-  DEBUG(std::cout << "REDUCED:\n" << stringOfTerm(prog) << std::endl);
-
-  std::string outChannel;
-  Env emptyEnv;
-  State state = {.outChannel = outChannel, .env = emptyEnv};
-
-  DO_3DS(status_message("Interpreting..."); clear_top_screen(););
-  DEBUG(std::cout << "START INTERPRET\n==================" << std::endl);
-
-  bool exception = false;
-  while (true) {
-    std::optional<std::pair<Term, State>> result;
-    try {
-      result = step(prog, state);
-    } catch (const std::exception &e) {
-      exception = true;
-      ERR(e.what());
-      break;
+  // Perform at most `steps` steps, returns false once the program halted.
+  // Garbage is collected between steps, the VM collects on its own
+  bool advance(size_t steps, State &state) {
+    switch (engine) {
+    case SmallStep:
+      for (; steps > 0; steps--) {
+        std::optional<Term> next = step(prog, state);
+        if (!next)
+          return false;
+        prog = std::move(*next);
+        currentHeap->safepoint(NoRoots());
+      }
+      return true;
+
+    case CEK:
+      for (; steps > 0; steps--) {
+        if (!cek->step())
+          return false;
+        currentHeap->safepoint(*cek);
+      }
+      return true;
+
+    case Bytecode:
+      return vm->run(steps);
     }
-    if (!result)
-      break;
-    auto [nextTerm, nextState] = *result;
-    prog = nextTerm;
-    state = nextState;
+    return false;
+  }
+};
+
+Execution::Execution(Term prog, Context &context, Engine engine)
+    : prog(std::move(prog)), compiled(context), engine(engine), gc(ownHeap) {}
 
-    // DEBUG(std::cout << "**********" << std::endl << stringOfTerm(prog) << std::endl);
+Execution::Execution(Term prog, Context &context, Engine engine, Heap &heap,
+                     std::vector<Input> inputs)
+    : prog(std::move(prog)), compiled(context), engine(engine), gc(heap),
+      inputs(std::move(inputs)) {}
+
+Execution::~Execution() {
+  // Output of a cancelled program is still shown
+  context.outChannel.flush();
+}
 
-    stepCallback(state);
+void Execution::observe(StepObserver observer, size_t interval) {
+  this->observer = std::move(observer);
+  observeInterval = untilObserve = std::max<size_t>(interval, 1);
+}
+
+void Execution::start() {
+  DO_3DS(status_message("Interpreting..."));
+  DEBUG(compiled.diagnostics() << "START INTERPRET\n=================="
+                               << std::endl);
+
+  machine = std::make_unique<Machine>();
+  machine->engine = engine;
+  switch (engine) {
+  case SmallStep: {
+    // The input bound i binders above the program has index i. Values are
+    // closed, so substituting one leaves the others' indices alone
+    machine->prog = prog;
+    int depth = static_cast<int>(inputs.size());
+    for (const Input &input : inputs)
+      machine->prog = substitute(machine->prog, input.name,
+                                 reify(input.value), --depth);
+    break;
   }
+  case CEK: {
+    MachineEnv env = nullptr;
+    for (const Input &input : inputs)
+      env = bind(input.value, env);
+    machine->cek.emplace(prog, env);
+    break;
+  }
+  case Bytecode: {
+    std::vector<Symbol> names;
+    std::vector<Val> values;
+    for (const Input &input : inputs) {
+      names.push_back(input.name);
+      values.push_back(input.value);
+    }
+    compiledCode = std::make_shared<BytecodeProgram>(compileBytecode(
+        prog, TaskPool::shared().workers() ? FORK_COST : 0, names));
+    DEBUG(if (!termLargerThan(prog, DUMP_LIMIT)) compiled.diagnostics()
+          << "BYTECODE:\n"
+          << disassemble(*compiledCode) << std::endl);
+    machine->vm.emplace(*compiledCode, values);
+    break;
+  }
+  }
+}
 
-  if (!exception) {
+ReturnCode Execution::finish(ReturnCode code) {
+  context.outChannel.flush();
+  if (code == Ok) {
+    value = machine->result();
     DO_3DS(status_message("Done!"));
   }
-  DEBUG(std::cout << "\n==================\nEND INTERPRET" << std::endl);
+  DEBUG(compiled.diagnostics() << "\n==================\nEND INTERPRET"
+                               << std::endl);
+  machine.reset();
+  ended = true;
+  return status = code;
+}
+
+// Points the print primitives at a program's channel while it runs
+struct OutScope {
+  OutChannel *saved;
+
+  explicit OutScope(OutChannel &out) : saved(currentOut) { currentOut = &out; }
+  ~OutScope() {
+    if (currentOut->policy == OutChannel::PerRun)
+      currentOut->flush();
+    currentOut = saved;
+  }
+};
+
+ReturnCode Execution::run(Fuel fuel) {
+  if (ended)
+    return status;
+  ContextScope scope(compiled);
+  OutScope out(context.outChannel);
+  HeapScope heap(gc);
+
+  using clock = std::chrono::steady_clock;
+  auto deadline = clock::now() + std::chrono::microseconds(fuel.micros);
+  size_t steps = fuel.steps;
+
+  try {
+    if (!machine)
+      start();
+
+    while (true) {
+      size_t slice = fuel.micros ? CLOCK_SLICE : SIZE_MAX;
+      if (fuel.steps)
+        slice = std::min(slice, steps);
+      if (observer)
+        slice = std::min(slice, untilObserve);
+
+      if (!machine->advance(slice, context))
+        return finish(Ok);
+
+      if (observer && (untilObserve -= slice) == 0) {
+        untilObserve = observeInterval;
+        observer(context);
+      }
+
+      if (fuel.steps && (steps -= slice) == 0)
+        return OutOfFuel;
+      if (fuel.micros && clock::now() >= deadline)
+        return OutOfFuel;
+    }
+  } catch (const std::exception &e) {
+    return fail(e);
+  }
+}
+
+ReturnCode Execution::prepare() {
+  if (ended || machine)
+    return status;
+  ContextScope scope(compiled);
+  OutScope out(context.outChannel);
+  HeapScope heap(gc);
+  try {
+    start();
+    return Ok;
+  } catch (const std::exception &e) {
+    return fail(e);
+  }
+}
+
+ReturnCode Execution::fail(const std::exception &e) {
+  context.outChannel.flush();
+  message = e.what();
+  if (report) {
+    ERR(compiled.diagnostics(), e.what());
+  }
+  return finish(Error);
+}
+
+void runProgram(Term prog, Context &context, Engine engine) {
+  Execution(prog, context, engine).run();
+}
+
+void interpreterMain(std::string filename, Context &context, Engine engine) {
+  Term prog = compileFile(filename, context);
+  if (prog)
+    runProgram(prog, context, engine);
 }
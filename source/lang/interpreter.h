@@ -5,15 +5,124 @@
 #include "../globals.h"
 #include "passes/passes.h"
 #include "stdlib/stdlib.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
 
 struct State {
-  std::string outChannel;
+  OutChannel outChannel;
   Env env;
 };
 
-enum ReturnCode { Ok, OutOfFuel };
+enum ReturnCode { Ok, OutOfFuel, Error };
 
-void stepCallback(State state);
-void interpreterMain(std::string filename);
+// Evaluation engines selectable by interpreterMain
+enum Engine {
+  SmallStep, // substitution-based step(), kept for debugging
+  CEK,       // environment-based abstract machine (runtime/cek.h)
+  Bytecode   // bytecode compiler and stack VM (runtime/bytecode.h)
+};
+
+// Called with the execution context while a program runs
+using StepObserver = std::function<void(const State &)>;
+
+// Limits on one call to Execution::run, zero means unlimited
+struct Fuel {
+  size_t steps = 0;    // machine transitions (VM: instructions)
+  uint32_t micros = 0; // wall-clock time
+};
+
+// A value the program is run with, bound to its free variable `name`
+struct Input {
+  Symbol name;
+  Val value;
+};
+
+struct BytecodeProgram;
+
+// Estimated steps an operand must take for the bytecode engine to fork it
+// to another core
+#define FORK_COST 20000
+
+/*
+    A program being evaluated. run() returns OutOfFuel with the machine
+    state kept when a limit is hit, so the next call resumes where it
+    stopped. Ok means the program finished, Error that an exception was
+    reported. Destroying an unfinished Execution cancels it.
+
+    `context` is the one `prog` was compiled in and must outlive the
+    Execution: the engines that rewrite terms build them there, and errors
+    are reported to its diagnostics
+*/
+class Execution {
+public:
+  Execution(Term prog, Context &context, Engine engine = CEK);
+  // Run in `heap`, shared with other programs, with `inputs` bound to the
+  // variables free in `prog`, outermost first as resolve() was given them.
+  // Their values must be kept alive by the heap's persistent roots
+  Execution(Term prog, Context &context, Engine engine, Heap &heap,
+            std::vector<Input> inputs);
+  ~Execution();
+
+  ReturnCode run(Fuel fuel = {});
+  // Build the machine now instead of on the first run(), e.g. to time
+  // compiling the bytecode apart. Returns Error if that failed
+  ReturnCode prepare();
+  bool finished() const { return ended; }
+  // Message of the error that ended the program, empty if there was none
+  const std::string &error() const { return message; }
+  // Whether errors are also shown as they happen, on by default
+  void reportErrors(bool report) { this->report = report; }
+
+  // Call `observer` after every `interval` steps
+  void observe(StepObserver observer, size_t interval = 1);
+  const State &state() const { return context; }
+  OutChannel &output() { return context.outChannel; }
+  // Runtime values of this program, configure before the first run()
+  Heap &heap() { return gc; }
+  // What the program returned once it finished Ok. Lives in heap(), where
+  // nothing else may keep it alive
+  const Val &result() const { return value; }
+  // Bytecode of the program once started, null for the other engines. Code
+  // values the program made point into it
+  const std::shared_ptr<const BytecodeProgram> &bytecode() const {
+    return compiledCode;
+  }
+
+private:
+  struct Machine;
+
+  void start();
+  ReturnCode finish(ReturnCode code);
+  ReturnCode fail(const std::exception &e);
+
+  Term prog;
+  Context &compiled;
+  Engine engine;
+  Heap ownHeap;
+  Heap &gc; // outlives the machine, which points into it
+  std::vector<Input> inputs;
+  std::shared_ptr<const BytecodeProgram> compiledCode;
+  std::unique_ptr<Machine> machine;
+  Val value;
+  State context; // updated in place by the running machine
+  StepObserver observer;
+  size_t observeInterval = 1, untilObserve = 1;
+  bool ended = false;
+  ReturnCode status = Ok;
+  std::string message;
+  bool report = true;
+};
+
+// Typecheck and reduce a parsed program, returns nullptr on failure. The
+// program must have been parsed in `context`
+Term compileTerm(Term parsed, Context &context);
+// Parse, typecheck and reduce a program, returns nullptr on failure
+Term compileFile(std::string filename, Context &context);
+// Run a compiled program to completion
+void runProgram(Term prog, Context &context, Engine engine);
+void interpreterMain(std::string filename, Context &context,
+                     Engine engine = CEK);
 
 #endif /* INTERPRETER */
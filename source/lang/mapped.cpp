@@ -0,0 +1,50 @@
+#include "mapped.h"
+#include <cstdio>
+
+#ifndef __3DS__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::string &path) {
+#ifdef __3DS__
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f)
+    return;
+  found = true;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  if (size > 0) {
+    buffer.resize(size);
+    if (fread(buffer.data(), 1, size, f) == size_t(size)) {
+      bytes = buffer.data();
+      length = size;
+    }
+  }
+  fclose(f);
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+  found = true;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      bytes = static_cast<const uint8_t *>(p);
+      length = st.st_size;
+    }
+  }
+  close(fd);
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifndef __3DS__
+  if (bytes)
+    munmap(const_cast<uint8_t *>(bytes), length);
+#endif
+}
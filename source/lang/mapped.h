@@ -0,0 +1,33 @@
+#ifndef MAPPED
+#define MAPPED
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The contents of a file, mapped where the system can map files and read
+// whole otherwise (the 3DS). Empty if it cannot be opened
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path);
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  bool opened() const { return found; }
+  const uint8_t *data() const { return bytes; }
+  size_t size() const { return length; }
+  std::string_view text() const {
+    return {reinterpret_cast<const char *>(bytes), length};
+  }
+
+private:
+  const uint8_t *bytes = nullptr;
+  size_t length = 0;
+  bool found = false;
+  std::vector<uint8_t> buffer; // when read
+};
+
+#endif /* MAPPED */
@@ -1,6 +1,6 @@
 #include <cassert>
 #include <cctype>
-#include <fstream>
+#include <iterator>
 
 #include "driver.hpp"
 
@@ -17,31 +17,38 @@ int MC::MC_Driver::parse(const char *const filename_cstr) {
    * then this needs to be an if statement
    */
   assert(filename_cstr != nullptr);
-  std::ifstream in_file(filename_cstr);
-  if (!in_file.good()) {
+  mapped = std::make_unique<MappedFile>(filename_cstr);
+  if (!mapped->opened()) {
     return 1;
   }
 
-  std::string fn = filename_cstr;
-  file = open_file(fn);
-
   filename = filename_cstr;
 
-  return parse_helper(in_file);
+  return parse_helper(mapped->text());
 }
 
 int MC::MC_Driver::parse(std::istream &stream) {
   if (!stream.good() && stream.eof()) {
     return 1;
   }
-  return parse_helper(stream);
+  buffer.assign(std::istreambuf_iterator<char>(stream),
+                std::istreambuf_iterator<char>());
+  return parse_helper(buffer);
 }
 
-int MC::MC_Driver::parse_helper(std::istream &stream) {
+int MC::MC_Driver::parse(std::string_view text) { return parse_helper(text); }
+
+int MC::MC_Driver::parse_helper(std::string_view text) {
+  source = text;
+  line_starts.clear();
 
   delete (scanner);
   try {
-    scanner = new MC::MC_Scanner(&stream);
+    if (flex) {
+      scanner = new MC::FlexScanner(text);
+    } else {
+      scanner = new MC::FastScanner(text);
+    }
   } catch (std::bad_alloc &ba) {
     std::cerr << "Failed to allocate scanner: (" << ba.what()
               << "), exiting!!\n";
@@ -59,6 +66,34 @@ int MC::MC_Driver::parse_helper(std::istream &stream) {
   return parser->parse();
 }
 
+void MC::MC_Driver::index_lines() {
+  if (!line_starts.empty()) {
+    return;
+  }
+  line_starts.push_back(0);
+  for (std::size_t i = 0; i < source.size(); i++) {
+    if (source[i] == '\n') {
+      line_starts.push_back(i + 1);
+    }
+  }
+}
+
+int MC::MC_Driver::line_count() {
+  index_lines();
+  return line_starts.size();
+}
+
+std::string_view MC::MC_Driver::line(int number) {
+  index_lines();
+  if (number <= 0 || number > (int)line_starts.size()) {
+    return {};
+  }
+  std::size_t begin = line_starts[number - 1];
+  std::size_t end = number < (int)line_starts.size() ? line_starts[number] - 1
+                                                     : source.size();
+  return source.substr(begin, end - begin);
+}
+
 void MC::MC_Driver::add_upper() {
   uppercase++;
   chars++;
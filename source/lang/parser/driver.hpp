@@ -2,13 +2,16 @@
 #define __MCDRIVER_HPP__ 1
 
 #include <cstddef>
+#include <iostream>
 #include <istream>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include "scanner.hpp"
 
-#include "../../Notepad3DS/source/file.h"
-#include "../../Notepad3DS/source/file_io.h"
+#include "../mapped.h"
 
 #ifdef __3DS__
 #include "parser_3ds.hpp"
@@ -25,15 +28,27 @@ public:
   virtual ~MC_Driver();
 
   /**
-   * parse - parse from a file
+   * parse - parse from a file, read once (mapped on the host) and scanned
+   * in place
    * @param filename - valid string with input file
    */
   int parse(const char *filename);
   /**
-   * parse - parse from a c++ input stream
+   * parse - parse from a c++ input stream, read whole first
    * @param is - std::istream&, valid input stream
    */
   int parse(std::istream &iss);
+  /**
+   * parse - parse text in memory, scanned in place
+   * @param text - the source, kept alive until parsing returns
+   */
+  int parse(std::string_view text);
+
+  // Number of lines of the source being parsed, and line `number` from 1
+  // without its newline. Lines are only indexed once asked for, to report
+  // a syntax error
+  int line_count();
+  std::string_view line(int number);
 
   void add_upper();
   void add_lower();
@@ -41,9 +56,15 @@ public:
   void add_newline();
   void add_char();
 
-  File file;
   std::string filename = "unknown file";
+  std::ostream *errors = &std::cerr; // where syntax errors are reported
   Term root_term;
+  // root_term is `let x = e in ()` standing for the definition `let x = e`,
+  // which only a session can bind (see session.h)
+  bool definition = false;
+  // Scan with the flex-generated FlexScanner instead of the hand-written
+  // FastScanner, to check one against the other on real parses
+  bool flex = false;
 
   bool parse_ok;
 
@@ -52,7 +73,13 @@ public:
   MC::MC_Scanner *scanner = nullptr;
 
 private:
-  int parse_helper(std::istream &stream);
+  int parse_helper(std::string_view text);
+  void index_lines();
+
+  std::unique_ptr<MappedFile> mapped; // the file being parsed
+  std::string buffer;                 // or the stream's contents
+  std::string_view source;
+  std::vector<std::size_t> line_starts;
 
   std::size_t chars = 0;
   std::size_t words = 0;
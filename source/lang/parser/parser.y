@@ -46,7 +46,8 @@
 %type <Arg> arg
 %type <std::vector<Arg>> args
 
-%type <std::string> ID STRINGLIT
+%type <Symbol> ID
+%type <std::string> STRINGLIT
 %type <int> INTLIT
 %type <double> FLOATLIT
 
@@ -60,26 +61,41 @@
 %%
 
 program:
-    term  { driver.root_term = $1; }
+      term  { driver.root_term = std::move($1); }
+    /* Definitions without a body, each phrase of a session */
+    | LET ID COLON type EQUAL term
+        { driver.root_term = TermNode::LetTerm($2, std::move($4), std::move($6),
+                                               TermNode::Unit());
+          driver.definition = true; }
+    | LET ID args EQUAL term
+        { driver.root_term = TermNode::Func($2, std::move($3), std::move($5),
+                                            TermNode::Unit());
+          driver.definition = true; }
+    | LET ID EQUAL term
+        { driver.root_term = TermNode::LetTerm($2, TypeNode::Unknown(),
+                                               std::move($4), TermNode::Unit());
+          driver.definition = true; }
     ;
 
 term:
       nonlet_term
+        { $$ = std::move($1); }
     | LET ID COLON type EQUAL term IN term
-        { $$ = TermNode::LetTerm($2, $4, $6, $8); }
+        { $$ = TermNode::LetTerm($2, std::move($4), std::move($6), std::move($8)); }
     | LET ID args EQUAL term IN term
-        { $$ = TermNode::Func($2, $3, $5, $7); }
+        { $$ = TermNode::Func($2, std::move($3), std::move($5), std::move($7)); }
     | LET ID EQUAL term IN term
-        { $$ = TermNode::LetTerm($2, TypeNode::Unknown(), $4, $6); }
+        { $$ = TermNode::LetTerm($2, TypeNode::Unknown(), std::move($4), std::move($6)); }
     | nonlet_term SEMICOLON term
-        { $$ = TermNode::LetTerm("_", TypeNode::Unit(), $1, $3); }
+        { $$ = TermNode::LetTerm(Symbol(), TypeNode::Unit(), std::move($1), std::move($3)); }
     ;
 
+/* Left-recursive, each argument is appended in place */
 args:
       arg
-        { $$ = std::vector<Arg>{$1}; }
-    | arg args
-        { std::vector<Arg> v = $2; v.insert(v.begin(), $1); $$ = v; }
+        { $$.reserve(8); $$.push_back(std::move($1)); }
+    | args arg
+        { $$ = std::move($1); $$.push_back(std::move($2)); }
 
 arg:
       ID
@@ -87,20 +103,20 @@ arg:
     | LPAREN ID RPAREN
         { $$ = std::make_pair($2, TypeNode::Unknown()); }
     | LPAREN ID COLON type RPAREN
-        { $$ = std::make_pair($2, $4); }
+        { $$ = std::make_pair($2, std::move($4)); }
 
 nonlet_term:
       FUN ID COLON type EQUAL term
-        { $$ = TermNode::AbsTerm($2, $4, $6); }
+        { $$ = TermNode::AbsTerm($2, std::move($4), std::move($6)); }
     | app_term
-        { $$ = $1; }
+        { $$ = std::move($1); }
 
 app_term:
       app_term atom
         {
-            $$ = TermNode::AppTerm($1, $2);
+            $$ = TermNode::AppTerm(std::move($1), std::move($2));
         }
-    | atom   { $$ = $1; }
+    | atom   { $$ = std::move($1); }
     ;
 
 atom:
@@ -108,42 +124,42 @@ atom:
     | FALSE      { $$ = TermNode::Bool(false); }
     | INTLIT     { $$ = TermNode::Int($1); }
     | FLOATLIT   { $$ = TermNode::Float($1); }
-    | STRINGLIT  { $$ = TermNode::String($1); }
-    | ID         { $$ = TermNode::VarTerm($1, 0, TypeNode::Unknown()); }
+    | STRINGLIT  { $$ = TermNode::String(std::move($1)); }
+    | ID         { $$ = TermNode::VarTerm($1, TermNode::Var::Free, TypeNode::Unknown()); }
 
     | LPAREN RPAREN
         { $$ = TermNode::Unit(); }
 
     | LPAREN term COMMA term RPAREN
-        { $$ = TermNode::TupleTerm($2, $4); }
+        { $$ = TermNode::TupleTerm(std::move($2), std::move($4)); }
 
     | LPAREN term RPAREN
-        { $$ = $2; }   // group, now unambiguous
+        { $$ = std::move($2); }   // group, now unambiguous
     ;
 
 type:
-      arrow_type   { $$ = $1; }
+      arrow_type   { $$ = std::move($1); }
     ;
 
 arrow_type:
       tuple_type ARROW arrow_type
-        { $$ = TypeNode::ArrowType($1, $3); }
+        { $$ = TypeNode::ArrowType(std::move($1), std::move($3)); }
 
     | tuple_type
-        { $$ = $1; }
+        { $$ = std::move($1); }
     ;
 
 
 tuple_type:
       tuple_type STAR base_type
-        { $$ = TypeNode::TupleType($1, $3); }
+        { $$ = TypeNode::TupleType(std::move($1), std::move($3)); }
 
     | base_type
-        { $$ = $1; }
+        { $$ = std::move($1); }
     ;
 
 base_type:
-      LPAREN type RPAREN   { $$ = $2; }
+      LPAREN type RPAREN   { $$ = std::move($2); }
 
     | UNIT   { $$ = TypeNode::Unit(); }
     | BOOL   { $$ = TypeNode::Bool(); }
@@ -160,26 +176,25 @@ void MC::MC_Parser::error(const location_type &l, const std::string &msg)
     int line_no = l.begin.line;
     int col_start = l.begin.column;
     int col_end = l.end.column;
+    std::ostream &err = *driver.errors;
 
-    std::cerr << msg << ": " << driver.filename << ":" << line_no << ":" << col_start << "-" << col_end << std::endl;
+    err << msg << ": " << driver.filename << ":" << line_no << ":" << col_start << "-" << col_end << std::endl;
 
-    if (line_no <= 0 || line_no > (int)driver.file.lines.size())
+    if (line_no <= 0 || line_no > driver.line_count())
         return; // invalid line
 
     // Get the source line
-    auto iter = driver.file.lines.begin();
-    advance(iter, line_no - 1);
-    std::string line = char_vec_to_string(*iter);
+    std::string line(driver.line(line_no));
     line = strip(line); // remove leading/trailing whitespace
 
     // Print line number and line contents
-    std::cerr << line_no << " | " << line << "\n";
+    err << line_no << " | " << line << "\n";
 
     // Print caret line
-    std::cerr << std::string(std::to_string(line_no).length() + 3, ' '); // align under content
+    err << std::string(std::to_string(line_no).length() + 3, ' '); // align under content
     for (int i = 1; i < col_start; ++i)
-        std::cerr << ' ';
+        err << ' ';
     for (int i = col_start; i < col_end; ++i)
-        std::cerr << '^';
-    std::cerr << "\n";
+        err << '^';
+    err << "\n";
 }
@@ -0,0 +1,297 @@
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "scanner.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+using token = MC::MC_Parser::token;
+
+namespace {
+
+/*
+    Blocks of bytes compared at once. eq() sets `bits` bits of the mask per
+    byte equal to `c`, the first byte's lowest, so the first match is at
+    ctz(mask) / bits
+*/
+#if defined(__SSE2__)
+struct Block {
+  static constexpr int size = 16, bits = 1;
+  __m128i v;
+  explicit Block(const char *p)
+      : v(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p))) {}
+  uint64_t eq(char c) const {
+    return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c))));
+  }
+  static constexpr uint64_t all = 0xffff;
+};
+#elif defined(__ARM_NEON)
+struct Block {
+  static constexpr int size = 16, bits = 4;
+  uint8x16_t v;
+  explicit Block(const char *p)
+      : v(vld1q_u8(reinterpret_cast<const uint8_t *>(p))) {}
+  uint64_t eq(char c) const {
+    // Each 16-bit lane shifted right by 4 and narrowed keeps a nibble of
+    // each byte's result
+    uint8x16_t m = vceqq_u8(v, vdupq_n_u8(uint8_t(c)));
+    uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+  }
+  static constexpr uint64_t all = ~0ull;
+};
+#else
+// Eight bytes in a word, little-endian: the high bit of each byte is set
+// where it is equal, without carries between bytes
+struct Block {
+  static constexpr int size = 8, bits = 8;
+  uint64_t v;
+  explicit Block(const char *p) { memcpy(&v, p, sizeof v); }
+  uint64_t eq(char c) const {
+    constexpr uint64_t low = 0x7f7f7f7f7f7f7f7full;
+    uint64_t y = v ^ (0x0101010101010101ull * uint8_t(c));
+    return ~(((y & low) + low) | y | low);
+  }
+  static constexpr uint64_t all = 0x8080808080808080ull;
+};
+#endif
+
+inline int first(uint64_t mask) { return __builtin_ctzll(mask) / Block::bits; }
+
+// The first byte from `p` that is not a blank, `[ \t\r]`
+const char *skipBlanks(const char *p, const char *end) {
+  for (; end - p >= Block::size; p += Block::size) {
+    Block b(p);
+    uint64_t other = ~(b.eq(' ') | b.eq('\t') | b.eq('\r')) & Block::all;
+    if (other)
+      return p + first(other);
+  }
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+    p++;
+  return p;
+}
+
+// The first `a` or `b` from `p`, `end` if there is none
+const char *findEither(const char *p, const char *end, char a, char b) {
+  for (; end - p >= Block::size; p += Block::size) {
+    Block block(p);
+    if (uint64_t found = block.eq(a) | block.eq(b))
+      return p + first(found);
+  }
+  while (p < end && *p != a && *p != b)
+    p++;
+  return p;
+}
+
+// Past the comment whose `(*` ends at `p`, or the end of the text if it is
+// not closed. Comments nest
+const char *skipComment(const char *p, const char *end) {
+  for (int depth = 1; depth > 0;) {
+    p = findEither(p, end, '(', '*');
+    if (p == end)
+      break;
+    char c = *p++;
+    if (p < end && *p == (c == '(' ? '*' : ')')) {
+      depth += c == '(' ? 1 : -1;
+      p++;
+    }
+  }
+  return p;
+}
+
+// The closing quote of the string literal opened before `p`, null if it is
+// not closed: `"([^"\\]|\\.)*"`, where `.` is not a newline
+const char *stringEnd(const char *p, const char *end) {
+  while ((p = findEither(p, end, '"', '\\')) < end) {
+    if (*p == '"')
+      return p;
+    if (end - p < 2 || p[1] == '\n')
+      return nullptr;
+    p += 2;
+  }
+  return nullptr;
+}
+
+bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+bool isIdent(char c) {
+  return isDigit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         c == '_';
+}
+
+// Past `[eE][+-]?[0-9]+` at `p`, or `p` if there is none
+const char *exponent(const char *p, const char *end) {
+  if (p == end || (*p != 'e' && *p != 'E'))
+    return p;
+  const char *q = p + 1;
+  if (q < end && (*q == '+' || *q == '-'))
+    q++;
+  if (q == end || !isDigit(*q))
+    return p;
+  while (q < end && isDigit(*q))
+    q++;
+  return q;
+}
+
+int keyword(std::string_view word) {
+  switch (word.size()) {
+  case 2:
+    return word == "in" ? token::IN : 0;
+  case 3:
+    return word == "let"   ? token::LET
+           : word == "fun" ? token::FUN
+           : word == "int" ? token::INT
+                           : 0;
+  case 4:
+    return word == "true"   ? token::TRUE
+           : word == "unit" ? token::UNIT
+           : word == "bool" ? token::BOOL
+                            : 0;
+  case 5:
+    return word == "false"   ? token::FALSE
+           : word == "float" ? token::FLOAT
+                             : 0;
+  case 6:
+    return word == "string" ? token::STRING : 0;
+  default:
+    return 0;
+  }
+}
+
+} // namespace
+
+// Locations advance as lexer.l's YY_USER_ACTION and newline rule have them,
+// one step per run of blanks and per newline
+void MC::FastScanner::skipSpace(MC::MC_Parser::location_type *location) {
+  while (at < end) {
+    if (*at == '\n') {
+      if (location) {
+        location->step();
+        location->columns(1);
+        location->lines();
+      }
+      at++;
+      continue;
+    }
+    const char *p = skipBlanks(at, end);
+    if (p == at)
+      return;
+    if (location) {
+      location->step();
+      location->columns(p - at);
+    }
+    at = p;
+  }
+}
+
+int MC::FastScanner::yylex(MC::MC_Parser::semantic_type *const lval,
+                           MC::MC_Parser::location_type *location) {
+  while (true) {
+    skipSpace(location);
+    if (at == end)
+      return 0;
+
+    const char *start = at;
+    auto match = [&](const char *past) {
+      at = past;
+      if (location) {
+        location->step();
+        location->columns(at - start);
+      }
+    };
+    char c = *at, next = at + 1 < end ? at[1] : 0;
+    switch (c) {
+    case '(':
+      if (next == '*') {
+        // Like lexer.l, which reads comments past flex, only `(*` counts
+        // towards locations
+        match(at + 2);
+        at = skipComment(at, end);
+        continue;
+      }
+      match(at + 1);
+      return token::LPAREN;
+    case ')':
+      match(at + 1);
+      return token::RPAREN;
+    case ',':
+      match(at + 1);
+      return token::COMMA;
+    case ':':
+      match(at + 1);
+      return token::COLON;
+    case ';':
+      match(at + 1);
+      return token::SEMICOLON;
+    case '*':
+      match(at + 1);
+      return token::STAR;
+    case '=':
+      match(at + 1);
+      return token::EQUAL;
+    case '-':
+      if (next == '>') {
+        match(at + 2);
+        return token::ARROW;
+      }
+      break;
+    case '"':
+      if (const char *close = stringEnd(at + 1, end)) {
+        match(close + 1);
+        lval->build<std::string>(std::string(start + 1, close));
+        return token::STRINGLIT;
+      }
+      break;
+    default:
+      break;
+    }
+
+    if (isDigit(c)) {
+      const char *p = at;
+      while (p < end && isDigit(*p))
+        p++;
+      if (p < end && *p == '.') {
+        p++;
+        while (p < end && isDigit(*p))
+          p++;
+        p = exponent(p, end);
+        double f;
+        if (std::from_chars(start, p, f).ec != std::errc())
+          throw std::out_of_range("float literal " + std::string(start, p));
+        match(p);
+        lval->build<double>(f);
+        return token::FLOATLIT;
+      }
+      // An exponent belongs to the literal but, as std::stoi had it, not
+      // to its value
+      int i;
+      if (std::from_chars(start, p, i).ec != std::errc())
+        throw std::out_of_range("integer literal " + std::string(start, p));
+      match(exponent(p, end));
+      lval->build<int>(i);
+      return token::INTLIT;
+    }
+
+    if (isIdent(c)) {
+      const char *p = at + 1;
+      while (p < end && isIdent(*p))
+        p++;
+      match(p);
+      std::string_view word(start, p - start);
+      if (int kw = keyword(word))
+        return kw;
+      lval->build<Symbol>(Symbol::intern(word));
+      return token::ID;
+    }
+
+    // Anything else is skipped, as lexer.l's `.` rule does
+    match(at + 1);
+  }
+}
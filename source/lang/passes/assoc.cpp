@@ -16,7 +16,7 @@ inline const TermNode::App &asApp(const Term &t) {
   return std::get<TermNode::App>(t->payload);
 }
 
-Term insert(const std::string &name, Type type, Term body, Term continuation) {
+Term insert(Symbol name, Type type, Term body, Term continuation) {
   switch (body->kind) {
 
   case TermNode::TmLet: {
@@ -32,6 +32,53 @@ Term insert(const std::string &name, Type type, Term body, Term continuation) {
   }
 }
 
+inline bool isRedex(const Term &t) {
+  return t->kind == TermNode::TmApp && asApp(t).f->kind == TermNode::TmAbs;
+}
+
+/*
+    Long programs are spines of `let x = e1 in e2` (before beta) or
+    `(fun x -> e2) e1` (after beta) nested through e2. Walk the spine in a
+    loop and only recurse into the e1 side, which stays shallow.
+*/
+Term assocSpine(Term term) {
+  std::vector<Term> spine;
+  Term cur = term;
+  while (true) {
+    if (cur->kind == TermNode::TmLet) {
+      spine.push_back(cur);
+      cur = asLet(cur).e2;
+    } else if (isRedex(cur)) {
+      spine.push_back(cur);
+      cur = asAbs(asApp(cur).f).body;
+    } else {
+      break;
+    }
+  }
+
+  Term out;
+  if (cur->kind == TermNode::TmApp) {
+    const auto &app = asApp(cur);
+    out = TermNode::AppTerm(assoc(app.f), assoc(app.arg));
+  } else {
+    out = assoc(cur);
+  }
+
+  for (auto it = spine.rbegin(); it != spine.rend(); ++it) {
+    if ((*it)->kind == TermNode::TmLet) {
+      const auto &let = asLet(*it);
+      // Insert deeply nested lets
+      out = insert(let.name, let.type, assoc(let.e1), out);
+    } else {
+      const auto &app = asApp(*it);
+      const auto &abs = asAbs(app.f);
+      out = TermNode::AppTerm(TermNode::AbsTerm(abs.param, abs.paramType, out),
+                              assoc(app.arg));
+    }
+  }
+  return out;
+}
+
 Term assoc(Term term) {
   switch (term->kind) {
 
@@ -44,6 +91,7 @@ Term assoc(Term term) {
   case TermNode::TmFloat:
   case TermNode::TmString:
   case TermNode::TmVar:
+  case TermNode::TmPrim:
     return term;
 
   // -------------------------
@@ -65,22 +113,8 @@ Term assoc(Term term) {
   // -------------------------
   // Application
   // -------------------------
-  case TermNode::TmApp: {
-    const auto &app = asApp(term);
-    return TermNode::AppTerm(assoc(app.f), assoc(app.arg));
-  }
-
-  // -------------------------
-  // Let
-  // -------------------------
-  case TermNode::TmLet: {
-    const auto &let = asLet(term);
-
-    Term e1p = assoc(let.e1);
-    Term e2p = assoc(let.e2);
-
-    // Insert deeply nested lets
-    return insert(let.name, let.type, e1p, e2p);
-  }
+  case TermNode::TmApp:
+  case TermNode::TmLet:
+    return assocSpine(term);
   }
 }
@@ -9,30 +9,34 @@ Term lookup(Term x, const Env &env) {
   return (it == env.end() ? x : it->second);
 }
 
-Term substitute(Term t, const std::string &x, Term v) {
+// Depth below one more binder, `_` never binds (see resolve())
+inline int under(Symbol binder, int depth) {
+  return binder.isWildcard() ? depth : depth + 1;
+}
+
+Term substitute(Term t, Symbol x, Term v, int depth) {
   switch (t->kind) {
 
   case TermNode::TmVar: {
     auto &var = std::get<TermNode::Var>(t->payload);
-    // _ is a special placeholder: never substitute it
-    if (var.name == "_")
-      return t;
-    return (var.name == x ? v : t);
+    return (var.index == depth ? v : t);
   }
 
   case TermNode::TmApp: {
     auto &ap = std::get<TermNode::App>(t->payload);
-    return TermNode::AppTerm(substitute(ap.f, x, v), substitute(ap.arg, x, v));
+    return TermNode::AppTerm(substitute(ap.f, x, v, depth),
+                             substitute(ap.arg, x, v, depth));
   }
 
   case TermNode::TmAbs: {
     auto &fn = std::get<TermNode::Abs>(t->payload);
 
-    // If binder shadows x, leave unchanged
+    // If binder shadows x, nothing below refers to it
     if (fn.param == x)
       return t;
 
-    return TermNode::AbsTerm(fn.param, fn.paramType, substitute(fn.body, x, v));
+    return TermNode::AbsTerm(fn.param, fn.paramType,
+                             substitute(fn.body, x, v, under(fn.param, depth)));
   }
 
   case TermNode::TmLet: {
@@ -41,19 +45,19 @@ Term substitute(Term t, const std::string &x, Term v) {
     // Shadowing: let x = ... in ...
     if (lt.name == x) {
       // substitute only in e1
-      return TermNode::LetTerm(lt.name, lt.type, substitute(lt.e1, x, v),
+      return TermNode::LetTerm(lt.name, lt.type, substitute(lt.e1, x, v, depth),
                                lt.e2 // unchanged
       );
     }
 
-    return TermNode::LetTerm(lt.name, lt.type, substitute(lt.e1, x, v),
-                             substitute(lt.e2, x, v));
+    return TermNode::LetTerm(lt.name, lt.type, substitute(lt.e1, x, v, depth),
+                             substitute(lt.e2, x, v, under(lt.name, depth)));
   }
 
   case TermNode::TmTuple: {
     auto &tp = std::get<TermNode::Tuple>(t->payload);
-    return TermNode::TupleTerm(substitute(tp.left, x, v),
-                               substitute(tp.right, x, v));
+    return TermNode::TupleTerm(substitute(tp.left, x, v, depth),
+                               substitute(tp.right, x, v, depth));
   }
 
   default:
@@ -70,12 +74,11 @@ Term beta_step(Term t, Env &env) {
   case TermNode::TmInt:
   case TermNode::TmFloat:
   case TermNode::TmString:
+  case TermNode::TmPrim:
     return t;
 
   /* ---------- Variable ---------- */
   case TermNode::TmVar: {
-    if (isPrimitive(t))
-      return t;
     Term r = lookup(t, env);
     return (r ? r : t);
   }
@@ -130,10 +133,17 @@ Term beta_step(Term t, Env &env) {
 
   /* ---------- Let binding ---------- */
   case TermNode::TmLet: {
-    auto &lt = std::get<TermNode::Let>(t->payload);
-    return TermNode::AppTerm(
-        TermNode::AbsTerm(lt.name, lt.type, beta_step(lt.e2, env)),
-        beta_step(lt.e1, env));
+    // Rewrite the whole let spine in a loop rather than recursing into e2
+    std::vector<const TermNode::Let *> spine;
+    Term cur = t;
+    for (; cur->kind == TermNode::TmLet; cur = spine.back()->e2)
+      spine.push_back(&std::get<TermNode::Let>(cur->payload));
+
+    Term out = beta_step(cur, env);
+    for (auto it = spine.rbegin(); it != spine.rend(); ++it)
+      out = TermNode::AppTerm(TermNode::AbsTerm((*it)->name, (*it)->type, out),
+                              beta_step((*it)->e1, env));
+    return out;
   }
   }
 
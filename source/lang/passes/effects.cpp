@@ -0,0 +1,188 @@
+#include "passes.h"
+#include <algorithm>
+
+namespace {
+
+// Estimates saturate rather than overflow, nested calls multiply them
+constexpr uint64_t COST_MAX = uint64_t(1) << 62;
+
+uint64_t plus(uint64_t a, uint64_t b) { return std::min(a + b, COST_MAX); }
+
+/*
+    What evaluating a term does. Calling its value is tracked apart from
+    evaluating it: `fun x -> print_int x` is pure, its applications are not.
+    Applying a value that is called anyway covers curried applications too
+*/
+struct Summary {
+  bool pure;       // evaluating it performs no I/O
+  bool pureCalls;  // nor does applying its value, to any number of arguments
+  uint64_t cost;   // estimated steps to evaluate the term
+  uint64_t latent; // estimated steps to apply its value
+};
+
+// What is known of a variable's value. Parameters can be anything
+struct Binding {
+  bool pureCalls;
+  uint64_t latent;
+};
+
+class Analysis {
+public:
+  Analysis(uint64_t minCost, PureSites &sites)
+      : minCost(minCost), sites(sites) {}
+
+  Summary term(const Term &t) {
+    switch (t->kind) {
+    case TermNode::TmUnit:
+    case TermNode::TmBool:
+    case TermNode::TmInt:
+    case TermNode::TmFloat:
+    case TermNode::TmString:
+      return {true, true, 1, 0};
+
+    case TermNode::TmPrim: {
+      bool io = performsIO(std::get<TermNode::Prim>(t->payload).prim);
+      return {true, !io, 1, 1};
+    }
+
+    case TermNode::TmVar: {
+      int index = std::get<TermNode::Var>(t->payload).index;
+      if (index < 0 || static_cast<size_t>(index) >= binders.size())
+        return {false, false, 1, 0};
+      const Binding &b = binders[binders.size() - 1 - index];
+      return {true, b.pureCalls, 1, b.latent};
+    }
+
+    case TermNode::TmTuple: {
+      auto &tup = std::get<TermNode::Tuple>(t->payload);
+      Summary left = site(tup.left), right = site(tup.right);
+      return {left.pure && right.pure, true,
+              plus(plus(left.cost, right.cost), 1), 0};
+    }
+
+    case TermNode::TmAbs: {
+      auto &abs = std::get<TermNode::Abs>(t->payload);
+      push(abs.param, {false, 0});
+      Summary body = term(abs.body);
+      pop(abs.param);
+      return {true, body.pure && body.pureCalls, 1,
+              plus(body.cost, body.latent)};
+    }
+
+    case TermNode::TmLet:
+    case TermNode::TmApp:
+      return spine(t);
+    }
+    return {false, false, 1, 0};
+  }
+
+private:
+  uint64_t minCost;
+  PureSites &sites;
+  std::vector<Binding> binders; // innermost last
+
+  void push(Symbol name, Binding b) {
+    if (!name.isWildcard())
+      binders.push_back(b);
+  }
+  void pop(Symbol name) {
+    if (!name.isWildcard())
+      binders.pop_back();
+  }
+
+  // Analyse a sibling the compiler may fork. A slot shared by several
+  // occurrences must qualify in all of them
+  Summary site(const Term &slot) {
+    Summary s = term(slot);
+    bool fits = s.pure && s.cost >= minCost;
+    auto it = sites.find(&slot);
+    if (it == sites.end())
+      sites.emplace(&slot, fits ? s.cost : 0);
+    else if (!fits)
+      it->second = 0;
+    return s;
+  }
+
+  /*
+      Let spines and the redexes reduce() turns them into nest through
+      their bodies, so walk them in a loop as the bytecode compiler does.
+      A redex binds its parameters like lets bind their names
+  */
+  Summary spine(const Term &t) {
+    std::vector<Symbol> bound;
+    Summary total{true, true, 0, 0};
+    auto add = [&](const Summary &s) {
+      total.pure = total.pure && s.pure;
+      total.cost = plus(plus(total.cost, s.cost), 1);
+    };
+
+    const Term *cur = &t;
+    while (true) {
+      if ((*cur)->kind == TermNode::TmLet) {
+        auto &let = std::get<TermNode::Let>((*cur)->payload);
+        Summary e1 = term(let.e1);
+        add(e1);
+        push(let.name, {e1.pureCalls, e1.latent});
+        bound.push_back(let.name);
+        cur = &let.e2;
+        continue;
+      }
+
+      // `(fun x1 -> ... fun xn -> body) e1 ... en`
+      std::vector<const Term *> args;
+      const Term *head = cur;
+      while ((*head)->kind == TermNode::TmApp) {
+        auto &app = std::get<TermNode::App>((*head)->payload);
+        args.push_back(&app.arg);
+        head = &app.f;
+      }
+      std::reverse(args.begin(), args.end());
+      std::vector<const TermNode::Abs *> params;
+      for (; params.size() < args.size() && (*head)->kind == TermNode::TmAbs;
+           head = &params.back()->body)
+        params.push_back(&std::get<TermNode::Abs>((*head)->payload));
+      if (args.empty() || params.size() < args.size())
+        break;
+
+      std::vector<Summary> values;
+      for (const Term *arg : args) {
+        values.push_back(site(*arg));
+        add(values.back());
+      }
+      for (size_t i = 0; i < params.size(); i++) {
+        push(params[i]->param, {values[i].pureCalls, values[i].latent});
+        bound.push_back(params[i]->param);
+      }
+      cur = &params.back()->body;
+    }
+
+    Summary last;
+    if ((*cur)->kind == TermNode::TmApp) {
+      auto &app = std::get<TermNode::App>((*cur)->payload);
+      Summary f = site(app.f), arg = site(app.arg);
+      last = {f.pure && arg.pure && f.pureCalls, f.pureCalls,
+              plus(plus(plus(f.cost, arg.cost), f.latent), 1), f.latent};
+    } else {
+      last = term(*cur);
+    }
+    total.pure = total.pure && last.pure;
+    total.pureCalls = last.pureCalls;
+    total.cost = plus(total.cost, last.cost);
+    total.latent = last.latent;
+
+    for (auto it = bound.rbegin(); it != bound.rend(); ++it)
+      pop(*it);
+    return total;
+  }
+};
+
+} // namespace
+
+PureSites pureSites(const Term &program, uint64_t minCost) {
+  PureSites sites;
+  Analysis(minCost, sites).term(program);
+  // Only the slots worth a thread are of interest
+  for (auto it = sites.begin(); it != sites.end();)
+    it = it->second ? std::next(it) : sites.erase(it);
+  return sites;
+}
@@ -9,17 +9,38 @@
 #include <stdexcept>
 #include <unordered_map>
 
-typedef std::unordered_map<std::string, Term> Env;
+typedef std::unordered_map<Symbol, Term> Env;
 
 bool isValue(Term term);
 
-Term substitute(Term t, const std::string &x, Term v);
+/*
+    Substitute the closed value `v` for the variable bound `depth` binders
+    above `t`, `x` is that binder's name and stops the walk where it is
+    shadowed
+*/
+Term substitute(Term t, Symbol x, Term v, int depth = 0);
 
 /*
     primitive argument rewriting
     `<primitive> a b c d ...` -> `primitive (a, (b, (c, (d, ...))))`
+    for the free variables naming one of `primitives`
+*/
+Term primitiveArgs(Term t, const PrimitiveTable &primitives);
+
+/*
+    name resolution
+    ---------------
+    Fill every variable with its de Bruijn index: the number of binders
+    between the occurrence and the one that binds it. `_` never binds, and
+    unbound references to `primitives` become TmPrim nodes. `outer` names
+    binders around `t`, outermost first, e.g. a session's definitions
 */
-Term primitiveArgs(Term t);
+Term resolve(Term t, const PrimitiveTable &primitives,
+             const std::vector<Symbol> &outer = {});
+
+// Names of the variables resolve() left unbound in `t`, first occurrence
+// first
+std::vector<Symbol> freeVariables(const Term &t);
 
 /*
     beta-reduction
@@ -36,8 +57,23 @@ Term beta(Term term);
 */
 Term assoc(Term term);
 
-// Perform all reduction passes
-Term reduce(Term term);
+// Perform all reduction passes, building the result in `context`
+Term reduce(Term term, Context &context);
+
+/*
+    effect analysis
+    ---------------
+    A subterm is pure when evaluating it cannot perform I/O: it calls no
+    print_ or read_ primitive, directly or through the functions it applies.
+    Functions passed in as arguments are assumed to, the type checker does
+    not record parameter types to tell them from other values.
+
+    Returns the pure operands of tuples and applications estimated to take
+    at least `minCost` steps, keyed by their slot in the parent node, with
+    that estimate. Runs on resolved terms
+*/
+using PureSites = std::unordered_map<const Term *, uint64_t>;
+PureSites pureSites(const Term &program, uint64_t minCost);
 
 // Errors
 struct TypeError : public std::runtime_error {
@@ -58,10 +94,15 @@ struct UnifyError : public std::runtime_error {
 // (we key by pointer identity of TypeNode representing unknown type variables)
 using Subst = std::unordered_map<const TypeNode *, Type>;
 
-// Helper: an environment mapping variable names to Types
-using EnvType = std::unordered_map<std::string, Type>;
+// Helper: the types of the binders in scope, innermost last, so a variable
+// with de Bruijn index i has type env[env.size() - 1 - i]
+using EnvType = std::vector<Type>;
+
+// Infer the type of `t` under the binders in `env`
+Type infer(Term t, EnvType &env);
 
-// Type check and infer types for the program
-Term typecheck(const Term &program);
+// Type check and infer types for the program under the binders in `env`,
+// building the result in `context`
+Term typecheck(const Term &program, Context &context, EnvType env = {});
 
 #endif /* REDUCTIONS */
@@ -13,14 +13,28 @@ std::vector<Type> typeListOfTuple(TypeNode::Tuple t) {
   return out;
 }
 
-Term primitiveArgs(Term t) {
+// `_arg<i>`, interned once for the positions primitives have rather than
+// per occurrence
+Symbol argName(size_t i) {
+  static const std::vector<Symbol> names = [] {
+    std::vector<Symbol> v;
+    for (size_t k = 0; k < 8; k++)
+      v.push_back(Symbol::intern("_arg" + std::to_string(k)));
+    return v;
+  }();
+  return i < names.size() ? names[i]
+                          : Symbol::intern("_arg" + std::to_string(i));
+}
+
+Term primitiveArgs(Term t, const PrimitiveTable &primitives) {
   switch (t->kind) {
   case TermNode::TmVar: {
-    if (!isPrimitive(t))
+    // Runs before resolve(), so primitives are still recognized by name
+    auto var = std::get<TermNode::Var>(t->payload);
+    if (primitives.count(var.name) == 0)
       return t;
 
-    auto var = std::get<TermNode::Var>(t->payload);
-    Type inType = primitives.at(var.name).t;
+    Type inType = primitives.at(var.name)->t;
     if (inType->kind != TypeNode::TArrow)
       return t;
     inType = std::get<TypeNode::Arrow>(inType->payload).param;
@@ -34,15 +48,18 @@ Term primitiveArgs(Term t) {
     }
 
     // 2. Generate fresh variable names
-    std::vector<std::string> names;
+    std::vector<Symbol> names;
     for (size_t i = 0; i < types.size(); i++)
-      names.push_back("_arg" + std::to_string(i));
+      names.push_back(argName(i));
 
-    // 3. Build a tuple of VarTerms
-    Term tupleArgs = TermNode::VarTerm(names[0], -1, types[0]);
-    for (size_t i = 1; i < types.size(); i++) {
+    // 3. Build a tuple of VarTerms, nested to the right like the type
+    size_t last = types.size() - 1;
+    Term tupleArgs =
+        TermNode::VarTerm(names[last], TermNode::Var::Free, types[last]);
+    for (size_t i = last; i-- > 0;) {
       tupleArgs = TermNode::TupleTerm(
-          tupleArgs, TermNode::VarTerm(names[i], -1, types[i]));
+          TermNode::VarTerm(names[i], TermNode::Var::Free, types[i]),
+          tupleArgs);
     }
 
     // 4. Apply primitive to tuple of arguments
@@ -58,24 +75,34 @@ Term primitiveArgs(Term t) {
 
   case TermNode::TmAbs: {
     auto abs = std::get<TermNode::Abs>(t->payload);
-    return TermNode::AbsTerm(abs.param, abs.paramType, primitiveArgs(abs.body));
+    return TermNode::AbsTerm(abs.param, abs.paramType,
+                             primitiveArgs(abs.body, primitives));
   }
 
   case TermNode::TmApp: {
     auto app = std::get<TermNode::App>(t->payload);
-    return TermNode::AppTerm(primitiveArgs(app.f), primitiveArgs(app.arg));
+    return TermNode::AppTerm(primitiveArgs(app.f, primitives),
+                             primitiveArgs(app.arg, primitives));
   }
 
   case TermNode::TmTuple: {
     auto tup = std::get<TermNode::Tuple>(t->payload);
-    return TermNode::TupleTerm(primitiveArgs(tup.left),
-                               primitiveArgs(tup.right));
+    return TermNode::TupleTerm(primitiveArgs(tup.left, primitives),
+                               primitiveArgs(tup.right, primitives));
   }
 
   case TermNode::TmLet: {
-    auto let = std::get<TermNode::Let>(t->payload);
-    return TermNode::LetTerm(let.name, let.type, primitiveArgs(let.e1),
-                             primitiveArgs(let.e2));
+    // Walk the let spine in a loop, `;` chains nest arbitrarily deep in e2
+    std::vector<const TermNode::Let *> spine;
+    Term cur = t;
+    for (; cur->kind == TermNode::TmLet; cur = spine.back()->e2)
+      spine.push_back(&std::get<TermNode::Let>(cur->payload));
+
+    Term out = primitiveArgs(cur, primitives);
+    for (auto it = spine.rbegin(); it != spine.rend(); ++it)
+      out = TermNode::LetTerm((*it)->name, (*it)->type,
+                              primitiveArgs((*it)->e1, primitives), out);
+    return out;
   }
 
   default:
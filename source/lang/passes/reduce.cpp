@@ -3,17 +3,18 @@
 
 Term step(Term term) { return assoc(beta(term)); }
 
-Term reduce(Term program) {
-  Term out = program;
-  DEBUG(std::cout << "START REDUCE" << std::endl);
+Term reduce(Term program, Context &context) {
+  ContextScope scope(context);
+  Term out = std::move(program);
+  DEBUG(context.diagnostics() << "START REDUCE" << std::endl);
   unsigned long long int fuel;
   for (fuel = __UINT16_MAX__; 0 < fuel; fuel--) {
     Term temp = step(out);
-    if (*temp == *out)
+    if (temp == out)
       break;
     out = temp;
   }
-  DEBUG(std::cout << "END REDUCE AFTER " << __UINT16_MAX__ - fuel << " STEPS"
-                  << std::endl);
+  DEBUG(context.diagnostics() << "END REDUCE AFTER " << __UINT16_MAX__ - fuel
+                              << " STEPS" << std::endl);
   return out;
 }
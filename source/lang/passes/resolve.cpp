@@ -0,0 +1,183 @@
+#include "passes.h"
+#include <unordered_set>
+
+namespace {
+
+/*
+    Binders in scope. Each symbol maps to the stack of depths it was bound
+    at, so resolving a variable does not scan the whole scope. Hashed rather
+    than indexed by symbol ID, so resolving a small term in a long session
+    does not pay for every name interned before it
+*/
+struct Scope {
+  const PrimitiveTable &primitives; // what free variables may name
+  std::unordered_map<Symbol, std::vector<int>> depths;
+  int depth = 0;
+
+  void push(Symbol name) {
+    if (name.isWildcard())
+      return;
+    depths[name].push_back(depth++);
+  }
+
+  void pop(Symbol name) {
+    if (name.isWildcard())
+      return;
+    depth--;
+    depths[name].pop_back();
+  }
+
+  int index(Symbol name) const {
+    auto it = depths.find(name);
+    if (it != depths.end() && !it->second.empty())
+      return depth - 1 - it->second.back();
+    return TermNode::Var::Free;
+  }
+};
+
+inline bool isRedex(const Term &t) {
+  return t->kind == TermNode::TmApp &&
+         std::get<TermNode::App>(t->payload).f->kind == TermNode::TmAbs;
+}
+
+Term resolveIn(const Term &t, Scope &scope);
+
+/*
+    `let x = e1 in e2` (before reduce) and `(fun x -> e2) e1` (after) nest
+    through e2, so walk that spine in a loop and only recurse into e1
+*/
+Term resolveSpine(const Term &t, Scope &scope) {
+  std::vector<std::pair<Term, Term>> spine; // binder node, resolved e1
+  Term cur = t;
+  while (true) {
+    if (cur->kind == TermNode::TmLet) {
+      auto &let = std::get<TermNode::Let>(cur->payload);
+      spine.emplace_back(cur, resolveIn(let.e1, scope));
+      scope.push(let.name);
+      cur = let.e2;
+    } else if (isRedex(cur)) {
+      auto &app = std::get<TermNode::App>(cur->payload);
+      spine.emplace_back(cur, resolveIn(app.arg, scope));
+      scope.push(std::get<TermNode::Abs>(app.f->payload).param);
+      cur = std::get<TermNode::Abs>(app.f->payload).body;
+    } else {
+      break;
+    }
+  }
+
+  Term out;
+  if (cur->kind == TermNode::TmApp) {
+    auto &app = std::get<TermNode::App>(cur->payload);
+    out = TermNode::AppTerm(resolveIn(app.f, scope), resolveIn(app.arg, scope));
+  } else {
+    out = resolveIn(cur, scope);
+  }
+
+  for (auto it = spine.rbegin(); it != spine.rend(); ++it) {
+    auto &[node, e1] = *it;
+    if (node->kind == TermNode::TmLet) {
+      auto &let = std::get<TermNode::Let>(node->payload);
+      scope.pop(let.name);
+      out = TermNode::LetTerm(let.name, let.type, e1, out);
+    } else {
+      auto &abs = std::get<TermNode::Abs>(
+          std::get<TermNode::App>(node->payload).f->payload);
+      scope.pop(abs.param);
+      out = TermNode::AppTerm(TermNode::AbsTerm(abs.param, abs.paramType, out),
+                              e1);
+    }
+  }
+  return out;
+}
+
+Term resolveIn(const Term &t, Scope &scope) {
+  switch (t->kind) {
+  case TermNode::TmVar: {
+    auto &var = std::get<TermNode::Var>(t->payload);
+    int index = scope.index(var.name);
+    if (index == TermNode::Var::Free) {
+      auto prim = scope.primitives.find(var.name);
+      if (prim != scope.primitives.end())
+        return TermNode::PrimTerm(var.name, prim->second, prim->second->t);
+    }
+    if (index == var.index)
+      return t;
+    return TermNode::VarTerm(var.name, index, t->type);
+  }
+
+  case TermNode::TmTuple: {
+    auto &tup = std::get<TermNode::Tuple>(t->payload);
+    return TermNode::TupleTerm(resolveIn(tup.left, scope),
+                               resolveIn(tup.right, scope));
+  }
+
+  case TermNode::TmAbs: {
+    auto &abs = std::get<TermNode::Abs>(t->payload);
+    scope.push(abs.param);
+    Term body = resolveIn(abs.body, scope);
+    scope.pop(abs.param);
+    return TermNode::AbsTerm(abs.param, abs.paramType, body);
+  }
+
+  case TermNode::TmLet:
+  case TermNode::TmApp:
+    return resolveSpine(t, scope);
+
+  default:
+    return t;
+  }
+}
+
+} // namespace
+
+Term resolve(Term t, const PrimitiveTable &primitives,
+             const std::vector<Symbol> &outer) {
+  Scope scope{primitives};
+  for (Symbol name : outer)
+    scope.push(name);
+  return resolveIn(t, scope);
+}
+
+std::vector<Symbol> freeVariables(const Term &t) {
+  std::vector<Symbol> names;
+  std::unordered_set<Symbol> seen;
+  // Resolved terms need no scope, so the walk keeps no binder stack and can
+  // visit nodes in any order
+  std::vector<const TermNode *> pending{t.get()};
+  while (!pending.empty()) {
+    const TermNode *node = pending.back();
+    pending.pop_back();
+    switch (node->kind) {
+    case TermNode::TmVar: {
+      auto &var = std::get<TermNode::Var>(node->payload);
+      if (var.index == TermNode::Var::Free && seen.insert(var.name).second)
+        names.push_back(var.name);
+      break;
+    }
+    case TermNode::TmTuple: {
+      auto &tup = std::get<TermNode::Tuple>(node->payload);
+      pending.push_back(tup.right.get());
+      pending.push_back(tup.left.get());
+      break;
+    }
+    case TermNode::TmAbs:
+      pending.push_back(std::get<TermNode::Abs>(node->payload).body.get());
+      break;
+    case TermNode::TmLet: {
+      auto &let = std::get<TermNode::Let>(node->payload);
+      pending.push_back(let.e2.get());
+      pending.push_back(let.e1.get());
+      break;
+    }
+    case TermNode::TmApp: {
+      auto &app = std::get<TermNode::App>(node->payload);
+      pending.push_back(app.arg.get());
+      pending.push_back(app.f.get());
+      break;
+    }
+    default:
+      break;
+    }
+  }
+  return names;
+}
@@ -33,10 +33,17 @@ Type deref_type(Type t) {
 Term deref_term(Term t) {
   switch (t->kind) {
   case TermNode::TmLet: {
-    auto let = std::get<TermNode::Let>(t->payload);
-    Type t2 = deref_type(let.type);
-    return TermNode::LetTerm(let.name, deref_type(let.type), deref_term(let.e1),
-                             deref_term(let.e2));
+    // Loop over the let spine instead of recursing into e2
+    std::vector<const TermNode::Let *> spine;
+    Term cur = t;
+    for (; cur->kind == TermNode::TmLet; cur = spine.back()->e2)
+      spine.push_back(&std::get<TermNode::Let>(cur->payload));
+
+    Term out = deref_term(cur);
+    for (auto it = spine.rbegin(); it != spine.rend(); ++it)
+      out = TermNode::LetTerm((*it)->name, deref_type((*it)->type),
+                              deref_term((*it)->e1), out);
+    return out;
   }
 
   case TermNode::TmApp: {
@@ -46,7 +53,7 @@ Term deref_term(Term t) {
 
   case TermNode::TmTuple: {
     auto tup = std::get<TermNode::Tuple>(t->payload);
-    return TermNode::AppTerm(deref_term(tup.left), deref_term(tup.right));
+    return TermNode::TupleTerm(deref_term(tup.left), deref_term(tup.right));
   }
 
   default:
@@ -80,6 +87,9 @@ bool occur(TypeNode::TypeVar r, Type t) {
   }
 }
 
+// Binds type variables in place. infer() makes them in the program's
+// context and the primitives' types have none, so no other program's types
+// are touched
 void unify(Type t1, Type t2) {
   // | Type.Var(r1), Type.Var(r2) when r1 == r2 -> ()
   if (t1->kind == TypeNode::TVar && t2->kind == TypeNode::TVar) {
@@ -160,7 +170,23 @@ void unify(Type t1, Type t2) {
   }
 }
 
-Type infer(Term t, EnvType env) {
+TypeError inferError(const Term &t, const UnifyError &e) {
+  return TypeError("infer {" + stringOfTerm(t) + "} {" + stringOfType(e.t1) +
+                   "} <> {" + stringOfType(e.t2) + "}");
+}
+
+// Bind `name` while checking a body, `_` never binds (see resolve())
+inline void pushBinder(EnvType &env, Symbol name, Type type) {
+  if (!name.isWildcard())
+    env.push_back(std::move(type));
+}
+
+inline void popBinder(EnvType &env, Symbol name) {
+  if (!name.isWildcard())
+    env.pop_back();
+}
+
+Type infer(Term t, EnvType &env) {
   try {
     switch (t->kind) {
     case TermNode::TmUnit:
@@ -174,21 +200,31 @@ Type infer(Term t, EnvType env) {
     case TermNode::TmString:
       return TypeNode::String();
     case TermNode::TmLet: {
-      auto let = std::get<TermNode::Let>(t->payload);
-      unify(let.type, infer(let.e1, env));
-
-      EnvType env2 = env;
-      env2[let.name] = let.type;
-      return infer(let.e2, env2);
+      // Check the let spine in a loop, binding each name in turn
+      size_t depth = env.size();
+      Term cur = t;
+      while (cur->kind == TermNode::TmLet) {
+        auto &let = std::get<TermNode::Let>(cur->payload);
+        try {
+          unify(let.type, infer(let.e1, env));
+        } catch (UnifyError &e) {
+          throw inferError(cur, e);
+        }
+        pushBinder(env, let.name, let.type);
+        cur = let.e2;
+      }
+      Type result = infer(cur, env);
+      env.resize(depth);
+      return result;
     }
     case TermNode::TmVar: {
-      auto var = std::get<TermNode::Var>(t->payload);
-      if (0 < env.count(var.name))
-        return env[var.name];
-      if (isPrimitive(t))
-        return primitives.at(var.name).t;
-      throw TypeError("infer: unexpected free variable " + var.name);
+      auto &var = std::get<TermNode::Var>(t->payload);
+      if (0 <= var.index && static_cast<size_t>(var.index) < env.size())
+        return env[env.size() - 1 - var.index];
+      throw TypeError("infer: unexpected free variable " + var.name.str());
     }
+    case TermNode::TmPrim:
+      return std::get<TermNode::Prim>(t->payload).prim->t;
     case TermNode::TmApp: {
       auto app = std::get<TermNode::App>(t->payload);
 
@@ -199,10 +235,11 @@ Type infer(Term t, EnvType env) {
       return t;
     }
     case TermNode::TmAbs: {
-      auto abs = std::get<TermNode::Abs>(t->payload);
-      EnvType env2 = env;
-      env2[abs.param] = abs.paramType;
-      return TypeNode::ArrowType(abs.paramType, infer(abs.body, env2));
+      auto &abs = std::get<TermNode::Abs>(t->payload);
+      pushBinder(env, abs.param, abs.paramType);
+      Type body = infer(abs.body, env);
+      popBinder(env, abs.param);
+      return TypeNode::ArrowType(abs.paramType, body);
     }
     case TermNode::TmTuple: {
       auto tup = std::get<TermNode::Tuple>(t->payload);
@@ -210,13 +247,12 @@ Type infer(Term t, EnvType env) {
     }
     }
   } catch (UnifyError &e) {
-    throw TypeError("infer {" + stringOfTerm(t) + "} {" + stringOfType(e.t1) +
-                    "} <> {" + stringOfType(e.t2) + "}");
+    throw inferError(t, e);
   }
 }
 
-Term typecheck(const Term &program) {
-  EnvType env;
+Term typecheck(const Term &program, Context &context, EnvType env) {
+  ContextScope scope(context);
   infer(program, env);
   return deref_term(program);
 }
@@ -0,0 +1,120 @@
+#pragma once
+#include "arena.h"
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/*
+    Intrusive reference counting
+    ----------------------------
+    Term and type nodes carry their own reference count, and Ref is the
+    handle that maintains it. A program's nodes are only touched by the
+    thread compiling or running it, so the count is a plain integer:
+    copying a handle is one increment, where a shared_ptr copy is an atomic
+    read-modify-write (an LDREX/STREX loop on the 3DS's ARM11). A node also
+    remembers the arena it came from, so the last handle can give its
+    memory back.
+
+    Nodes built with no arena, the primitives' types and the constants made
+    once for every program, are immortal: their count is never touched, so
+    every thread may share them
+*/
+struct RefCounted {
+  static constexpr uint32_t IMMORTAL = UINT32_MAX;
+
+  mutable uint32_t refs = 0;
+  NodeArena *arena = nullptr;
+
+  RefCounted() = default;
+  // A copied node is a new node, it starts with no handles
+  RefCounted(const RefCounted &) {}
+  RefCounted &operator=(const RefCounted &) { return *this; }
+};
+
+template <typename T> class Ref {
+public:
+  Ref() = default;
+  Ref(std::nullptr_t) {}
+  // Nodes count their own handles, so any raw node pointer may be adopted
+  explicit Ref(T *p) : p(p) { retain(); }
+  Ref(const Ref &other) : p(other.p) { retain(); }
+  Ref(Ref &&other) noexcept : p(other.p) { other.p = nullptr; }
+  template <typename U,
+            typename = std::enable_if_t<std::is_convertible_v<U *, T *>>>
+  Ref(const Ref<U> &other) : p(other.get()) {
+    retain();
+  }
+  template <typename U,
+            typename = std::enable_if_t<std::is_convertible_v<U *, T *>>>
+  Ref(Ref<U> &&other) noexcept : p(other.release()) {}
+  ~Ref() { drop(p); }
+
+  // `other` may live in the node this handle drops, as in `x = x->child`:
+  // it is read and cleared before the old node goes
+  Ref &operator=(const Ref &other) {
+    other.retain();
+    drop(std::exchange(p, other.p));
+    return *this;
+  }
+  Ref &operator=(Ref &&other) noexcept {
+    if (this != &other)
+      drop(std::exchange(p, std::exchange(other.p, nullptr)));
+    return *this;
+  }
+
+  T *get() const { return p; }
+  T &operator*() const { return *p; }
+  T *operator->() const { return p; }
+  explicit operator bool() const { return p != nullptr; }
+  uint32_t use_count() const { return p ? p->refs : 0; }
+
+  // Give up ownership without touching the count
+  T *release() {
+    T *out = p;
+    p = nullptr;
+    return out;
+  }
+
+  friend bool operator==(const Ref &a, const Ref &b) { return a.p == b.p; }
+  friend bool operator!=(const Ref &a, const Ref &b) { return a.p != b.p; }
+  friend bool operator==(const Ref &a, std::nullptr_t) { return !a.p; }
+  friend bool operator!=(const Ref &a, std::nullptr_t) { return a.p; }
+
+private:
+  T *p = nullptr;
+
+  void retain() const {
+    if (p && p->refs != RefCounted::IMMORTAL)
+      p->refs++;
+  }
+  static void drop(T *node) {
+    if (node && node->refs != RefCounted::IMMORTAL && --node->refs == 0)
+      destroy(node);
+  }
+
+  // Out of line: the common path stays small, and GCC's -Wuse-after-free
+  // cannot follow counts, it took two drops of one node for a use after free
+  [[gnu::noinline]] static void destroy(T *node) {
+    using Node = std::remove_const_t<T>;
+    Node *n = const_cast<Node *>(node);
+    NodeArena *arena = n->arena;
+    n->~Node();
+    if (arena)
+      arena->deallocate(n, sizeof(Node));
+    else
+      ::operator delete(n);
+  }
+};
+
+// Allocate a node from the current arena, an immortal one if there is none
+template <typename T, typename... Args> Ref<T> makeRef(Args &&...args) {
+  void *mem = currentArena ? currentArena->allocate(sizeof(T))
+                           : ::operator new(sizeof(T));
+  T *node = new (mem) T(std::forward<Args>(args)...);
+  node->arena = currentArena;
+  if (!currentArena)
+    node->refs = RefCounted::IMMORTAL;
+  return Ref<T>(node);
+}
@@ -0,0 +1,450 @@
+#include "bytecode.h"
+#include "../passes/passes.h"
+#include "../stdlib/stdlib.h"
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace {
+
+// A name bound in a slot. A binding that shadows one of the same let spine
+// takes over its slot, which nothing can read any more
+struct Local {
+  Symbol name;
+  uint16_t slot;
+  bool fresh;      // the slot was free, release() hands it back
+  size_t shadowed; // index in locals of the binding it hides, or NONE
+};
+
+// Compile-time view of one function being compiled
+struct Scope {
+  static constexpr size_t NONE = SIZE_MAX;
+
+  Scope *parent;
+  size_t fn;
+  std::vector<Local> locals; // innermost last
+  std::unordered_map<Symbol, size_t> innermost; // index in locals per name
+  std::vector<Symbol> captures;
+  uint16_t nextSlot = 0;
+};
+
+struct Ref {
+  enum Kind { Local, Upval } kind;
+  uint16_t index;
+};
+
+class Compiler {
+public:
+  Compiler(BytecodeProgram &out, PureSites sites)
+      : out(out), sites(std::move(sites)) {
+    for (size_t i = 0; i < primitive_list.size(); i++)
+      primIndex.emplace(&primitive_list[i].second, i);
+  }
+
+  // Compile `body` as a new function whose first slots hold `params`,
+  // returns the names it captures
+  std::vector<Symbol> function(const std::string &name, const Term &body,
+                               Scope *parent,
+                               const std::vector<Symbol> &params) {
+    Scope s{parent, out.functions.size()};
+    out.functions.push_back({name, 0, {}});
+    for (Symbol param : params)
+      declare(s, param);
+    expr(body, s);
+    emit(s, parent ? OP_RETURN : OP_HALT);
+    return std::move(s.captures);
+  }
+
+private:
+  BytecodeProgram &out;
+  PureSites sites; // operands worth forking
+  std::unordered_map<const Primitive *, size_t> primIndex;
+  std::vector<std::unordered_map<std::string, uint16_t>> constIndex; // per fn
+
+  std::vector<uint8_t> &code(Scope &s) { return out.functions[s.fn].code; }
+
+  void emit(Scope &s, uint8_t op) { code(s).push_back(op); }
+
+  void emit(Scope &s, uint8_t op, size_t operand) {
+    if (operand > UINT16_MAX)
+      throw std::runtime_error("bytecode: operand " + std::to_string(operand) +
+                               " does not fit in 16 bits");
+    code(s).push_back(op);
+    code(s).push_back(operand & 0xff);
+    code(s).push_back(operand >> 8);
+  }
+
+  // Bind `name` in a slot of its own, or in the slot of the innermost
+  // binding of `name` if it is one of locals[reusable, end)
+  uint16_t declare(Scope &s, Symbol name, size_t reusable = SIZE_MAX,
+                   size_t end = SIZE_MAX) {
+    auto found = s.innermost.find(name);
+    size_t shadowed = found == s.innermost.end() ? Scope::NONE : found->second;
+    s.innermost[name] = s.locals.size();
+    if (shadowed != Scope::NONE && shadowed >= reusable &&
+        shadowed < std::min(end, s.locals.size())) {
+      uint16_t slot = s.locals[shadowed].slot;
+      s.locals.push_back({name, slot, false, shadowed});
+      return slot;
+    }
+
+    if (s.nextSlot == UINT16_MAX)
+      throw std::runtime_error("bytecode: too many locals in " +
+                               out.functions[s.fn].name);
+    uint16_t slot = s.nextSlot++;
+    s.locals.push_back({name, slot, true, shadowed});
+    auto &fn = out.functions[s.fn];
+    if (s.nextSlot > fn.nlocals)
+      fn.nlocals = s.nextSlot;
+    return slot;
+  }
+
+  void release(Scope &s) {
+    Local &local = s.locals.back();
+    if (local.fresh)
+      s.nextSlot = local.slot;
+    if (local.shadowed == Scope::NONE)
+      s.innermost.erase(local.name);
+    else
+      s.innermost[local.name] = local.shadowed;
+    s.locals.pop_back();
+  }
+
+  std::optional<Ref> resolve(Scope &s, Symbol name) {
+    auto local = s.innermost.find(name);
+    if (local != s.innermost.end())
+      return Ref{Ref::Local, s.locals[local->second].slot};
+    for (size_t i = 0; i < s.captures.size(); i++)
+      if (s.captures[i] == name)
+        return Ref{Ref::Upval, static_cast<uint16_t>(i)};
+    if (s.parent) {
+      if (resolve(*s.parent, name)) {
+        s.captures.push_back(name);
+        return Ref{Ref::Upval, static_cast<uint16_t>(s.captures.size() - 1)};
+      }
+    }
+    return std::nullopt;
+  }
+
+  void load(Scope &s, Symbol name) {
+    auto ref = resolve(s, name);
+    if (!ref)
+      throw std::runtime_error("bytecode: unbound variable " + name.str());
+    switch (ref->kind) {
+    case Ref::Local:
+      emit(s, OP_LOCAL, ref->index);
+      break;
+    case Ref::Upval:
+      emit(s, OP_UPVAL, ref->index);
+      break;
+    }
+  }
+
+  // Index into primitive_list of a TmPrim
+  size_t primitive(const Term &t) {
+    return primIndex.at(std::get<TermNode::Prim>(t->payload).prim);
+  }
+
+  uint16_t constant(const Term &t, Scope &s) {
+    std::string key(1, static_cast<char>(t->kind));
+    switch (t->kind) {
+    case TermNode::TmBool:
+      key += std::get<bool>(t->payload) ? "1" : "0";
+      break;
+    case TermNode::TmInt:
+      key += std::to_string(std::get<int>(t->payload));
+      break;
+    case TermNode::TmFloat: {
+      double d = std::get<double>(t->payload);
+      char bytes[sizeof d];
+      std::memcpy(bytes, &d, sizeof d);
+      key.append(bytes, sizeof d);
+      break;
+    }
+    case TermNode::TmString:
+      key += std::get<std::string>(t->payload);
+      break;
+    default:
+      break;
+    }
+
+    if (constIndex.size() <= s.fn)
+      constIndex.resize(s.fn + 1);
+    auto &index = constIndex[s.fn];
+    auto it = index.find(key);
+    if (it != index.end())
+      return it->second;
+    auto &constants = out.functions[s.fn].constants;
+    if (constants.size() > UINT16_MAX)
+      throw std::runtime_error("bytecode: constant pool overflow");
+    uint16_t k = constants.size();
+    constants.push_back(reflect(t));
+    index.emplace(std::move(key), k);
+    return k;
+  }
+
+  // Bind the value on top of the stack, returns whether a local was added.
+  // Bindings from locals[spine] on end with this one and can be overwritten
+  bool bind(Symbol name, Scope &s, size_t spine) {
+    if (name.isWildcard()) {
+      emit(s, OP_POP);
+      return false;
+    }
+    emit(s, OP_SETLOCAL, declare(s, name, spine));
+    return true;
+  }
+
+  // The parameters of `(fun x1 -> ... fun xn -> body) e1 ... en`, empty if
+  // `t` is not such a saturated redex. Arguments are collected first to last
+  static std::vector<const TermNode::Abs *>
+  redex(const Term &t, std::vector<const Term *> &args) {
+    const Term *head = &t;
+    while ((*head)->kind == TermNode::TmApp) {
+      auto &app = std::get<TermNode::App>((*head)->payload);
+      args.push_back(&app.arg);
+      head = &app.f;
+    }
+    std::reverse(args.begin(), args.end());
+
+    std::vector<const TermNode::Abs *> params;
+    for (; params.size() < args.size() && (*head)->kind == TermNode::TmAbs;
+         head = &params.back()->body)
+      params.push_back(&std::get<TermNode::Abs>((*head)->payload));
+    if (params.size() < args.size())
+      params.clear();
+    return params;
+  }
+
+  // Terms that evaluate without failing or taking any time to speak of
+  static bool trivial(const Term &t) {
+    switch (t->kind) {
+    case TermNode::TmTuple:
+    case TermNode::TmLet:
+    case TermNode::TmApp:
+      return false;
+    default:
+      return true;
+    }
+  }
+
+  /*
+      Push the values of `terms`, first to last. When at least two are
+      worth forking and the others are trivial, the former run on the task
+      pool, each compiled as a function of no parameter. Joining them all at
+      once raises the error of the first that failed, as evaluating in
+      sequence would have, and pure terms leave nothing else to observe
+  */
+  void operands(const std::vector<const Term *> &terms, Scope &s) {
+    size_t forked = 0;
+    bool parallel = true;
+    for (const Term *t : terms) {
+      if (sites.count(t))
+        forked++;
+      else
+        parallel = parallel && trivial(*t);
+    }
+    if (!parallel || forked < 2) {
+      for (const Term *t : terms)
+        expr(*t, s);
+      return;
+    }
+
+    for (const Term *t : terms) {
+      if (!sites.count(t)) {
+        expr(*t, s);
+        continue;
+      }
+      Scope thunk{&s, out.functions.size()};
+      out.functions.push_back({"fork", 0, {}});
+      expr(*t, thunk);
+      emit(thunk, OP_HALT);
+      for (auto &name : thunk.captures)
+        load(s, name);
+      emit(s, OP_FORK, thunk.fn - s.fn);
+      code(s).push_back(thunk.captures.size() & 0xff);
+      code(s).push_back(thunk.captures.size() >> 8);
+    }
+    emit(s, OP_JOIN, forked);
+  }
+
+  void expr(const Term &t, Scope &s) {
+    // Let spines nest through their bodies, and `(fun x -> body) arg` is how
+    // reduce() spells let, so compile those inline in a loop. Redexes with
+    // several arguments, as primitiveArgs() wraps primitives in, bind all
+    // their parameters at once instead of allocating partial applications
+    const Term *cur = &t;
+    size_t bound = 0, spine = s.locals.size();
+    while (true) {
+      std::vector<const Term *> args;
+      std::vector<const TermNode::Abs *> params;
+      if ((*cur)->kind == TermNode::TmLet) {
+        auto &let = std::get<TermNode::Let>((*cur)->payload);
+        expr(let.e1, s);
+        bound += bind(let.name, s, spine);
+        cur = &let.e2;
+      } else if (!(params = redex(*cur, args)).empty()) {
+        operands(args, s);
+        // Slots are declared first to last so inner parameters shadow outer
+        // ones, then filled from the top of the stack: a parameter takes over
+        // the slot of a binding from before the redex only
+        std::vector<int> slots;
+        size_t before = s.locals.size();
+        for (auto *abs : params) {
+          slots.push_back(abs->param.isWildcard()
+                              ? -1
+                              : declare(s, abs->param, spine, before));
+          bound += !abs->param.isWildcard();
+        }
+        for (auto it = slots.rbegin(); it != slots.rend(); ++it) {
+          if (*it < 0)
+            emit(s, OP_POP);
+          else
+            emit(s, OP_SETLOCAL, *it);
+        }
+        cur = &params.back()->body;
+      } else {
+        break;
+      }
+    }
+
+    node(*cur, s);
+    for (; bound > 0; bound--)
+      release(s);
+  }
+
+  void node(const Term &t, Scope &s) {
+    switch (t->kind) {
+    case TermNode::TmUnit:
+    case TermNode::TmBool:
+    case TermNode::TmInt:
+    case TermNode::TmFloat:
+    case TermNode::TmString:
+      emit(s, OP_CONST, constant(t, s));
+      return;
+
+    case TermNode::TmVar:
+      load(s, std::get<TermNode::Var>(t->payload).name);
+      return;
+
+    case TermNode::TmPrim:
+      emit(s, OP_PRIM, primitive(t));
+      return;
+
+    case TermNode::TmTuple: {
+      auto &tup = std::get<TermNode::Tuple>(t->payload);
+      operands({&tup.left, &tup.right}, s);
+      emit(s, OP_TUPLE);
+      return;
+    }
+
+    case TermNode::TmLet: // handled by expr()
+      return;
+
+    case TermNode::TmApp: {
+      auto &app = std::get<TermNode::App>(t->payload);
+
+      // Saturated primitive call, binary primitives take a literal pair
+      // straight off the stack without building the tuple
+      if (app.f->kind == TermNode::TmPrim) {
+        size_t p = primitive(app.f);
+        if (app.arg->kind == TermNode::TmTuple &&
+            primitive_list[p].second.f2) {
+          auto &tup = std::get<TermNode::Tuple>(app.arg->payload);
+          operands({&tup.left, &tup.right}, s);
+          emit(s, OP_CALLPRIM2, p);
+          return;
+        }
+        expr(app.arg, s);
+        emit(s, OP_CALLPRIM, p);
+        return;
+      }
+
+      operands({&app.f, &app.arg}, s);
+      emit(s, OP_APPLY);
+      return;
+    }
+
+    case TermNode::TmAbs: {
+      auto &abs = std::get<TermNode::Abs>(t->payload);
+      size_t fn = out.functions.size();
+      std::vector<Symbol> captures =
+          function("fun " + abs.param.str(), abs.body, &s, {abs.param});
+      for (auto &name : captures)
+        load(s, name);
+      emit(s, OP_CLOSURE, fn - s.fn);
+      code(s).push_back(captures.size() & 0xff);
+      code(s).push_back(captures.size() >> 8);
+      return;
+    }
+    }
+  }
+};
+
+struct OpInfo {
+  const char *name;
+  int operands;
+};
+
+const OpInfo opInfo[OP_COUNT] = {
+    {"CONST", 1}, {"LOCAL", 1}, {"SETLOCAL", 1}, {"UPVAL", 1},
+    {"PRIM", 1},  {"CALLPRIM", 1}, {"CALLPRIM2", 1}, {"CLOSURE", 2},
+    {"TUPLE", 0}, {"APPLY", 0},   {"FORK", 2},  {"JOIN", 1},
+    {"POP", 0},   {"RETURN", 0},  {"HALT", 0}};
+
+} // namespace
+
+BytecodeProgram compileBytecode(const Term &program, uint64_t forkCost,
+                                const std::vector<Symbol> &inputs) {
+  BytecodeProgram out;
+  Compiler compiler(out, forkCost ? pureSites(program, forkCost) : PureSites());
+  compiler.function("main", program, nullptr, inputs);
+  return out;
+}
+
+std::string disassemble(const BytecodeProgram &program) {
+  std::ostringstream out;
+
+  for (size_t f = 0; f < program.functions.size(); f++) {
+    auto &fn = program.functions[f];
+    out << "== function " << f << " <" << fn.name << "> locals "
+        << fn.nlocals << " ==\n";
+
+    for (size_t pc = 0; pc < fn.code.size();) {
+      uint8_t op = fn.code[pc];
+      if (op >= OP_COUNT) {
+        out << std::setw(5) << pc << "  <bad opcode " << int(op) << ">\n";
+        break;
+      }
+      out << std::setw(5) << pc << "  " << std::left << std::setw(9)
+          << opInfo[op].name << std::right;
+      pc++;
+
+      std::vector<unsigned> operands;
+      for (int i = 0; i < opInfo[op].operands; i++, pc += 2) {
+        operands.push_back(fn.code[pc] | fn.code[pc + 1] << 8);
+        out << " " << std::setw(5) << operands.back();
+      }
+
+      switch (op) {
+      case OP_CONST:
+        out << "  ; " << stringOfValue(fn.constants[operands[0]]);
+        break;
+      case OP_PRIM:
+      case OP_CALLPRIM:
+      case OP_CALLPRIM2:
+        out << "  ; " << primitive_list[operands[0]].first;
+        break;
+      case OP_CLOSURE:
+      case OP_FORK:
+        out << "  ; <" << program.functions[f + operands[0]].name << ">";
+        break;
+      default:
+        break;
+      }
+      out << "\n";
+    }
+  }
+  return out.str();
+}
@@ -0,0 +1,128 @@
+#ifndef RUNTIME_BYTECODE_H
+#define RUNTIME_BYTECODE_H
+
+#include "value.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+    Bytecode
+    --------
+    Each opcode is one byte, followed by little-endian u16 operands:
+
+    CONST k          push constants[k] of the running function
+    LOCAL i          push local slot i of the current frame
+    SETLOCAL i       pop into local slot i
+    UPVAL i          push captured value i of the running closure
+    PRIM p           push primitive_list[p] as a value
+    CALLPRIM p       pop an argument, push primitive_list[p](argument)
+    CALLPRIM2 p      pop right, pop left, push primitive_list[p](left, right)
+    CLOSURE f n      pop n captured values, push a closure of functions[f]
+    TUPLE            pop right, pop left, push (left, right)
+    APPLY            pop argument, pop function, call it
+    FORK f n         pop n captured values, start functions[f] on the task
+                     pool and push a placeholder for its result
+    JOIN n           wait for the last n forks, replace their placeholders
+                     by their results or raise the first one's error
+    POP              discard the top of the stack
+    RETURN           return the top of the stack to the caller
+    HALT             stop, the top of the stack is the program result
+
+    Functions are numbered from the running one, which comes before those
+    it creates, and constants are per function: code does not depend on
+    which program it runs in, so a closure can be called by another
+    program's machine
+*/
+enum Opcode : uint8_t {
+  OP_CONST,
+  OP_LOCAL,
+  OP_SETLOCAL,
+  OP_UPVAL,
+  OP_PRIM,
+  OP_CALLPRIM,
+  OP_CALLPRIM2,
+  OP_CLOSURE,
+  OP_TUPLE,
+  OP_APPLY,
+  OP_FORK,
+  OP_JOIN,
+  OP_POP,
+  OP_RETURN,
+  OP_HALT,
+  OP_COUNT
+};
+
+struct BytecodeFunction {
+  std::string name;
+  uint16_t nlocals; // slot 0 holds the parameter, the entry point's first
+                    // slots the program's inputs
+  std::vector<uint8_t> code;
+  std::vector<Val> constants;
+};
+
+struct BytecodeProgram {
+  std::vector<BytecodeFunction> functions; // functions[0] is the entry point
+};
+
+// Compile a typed, reduced program. Pure operands estimated to take at least
+// `forkCost` steps are forked when two of them can run side by side, zero
+// never forks. `inputs` names the variables free in the program, the VM is
+// given their values
+BytecodeProgram compileBytecode(const Term &program, uint64_t forkCost = 0,
+                                const std::vector<Symbol> &inputs = {});
+
+std::string disassemble(const BytecodeProgram &program);
+
+class VM : public GcRoots {
+public:
+  // `inputs` are the values of the variables compileBytecode() was given
+  explicit VM(const BytecodeProgram &program,
+              const std::vector<Val> &inputs = {});
+  // Run a forked function, a closure in the current heap. The constants
+  // belong to the heap of the forking machine, they are copied when loaded
+  // rather than traced
+  VM(const BytecodeProgram &program, Val thunk);
+  // Waits for the machine's unjoined forks
+  ~VM();
+
+  // Mark the stack, the constants and the result. A running closure sits on
+  // the stack above its frame's locals, so its captures are reached too
+  void trace(Heap &heap) const override;
+
+  // Run the program to completion and return its result
+  Val run();
+  // Execute at most `fuel` instructions, returns false once the program
+  // halted. The machine state is kept, so run() can be called again
+  bool run(size_t fuel);
+
+  bool halted() const { return done; }
+  const Val &result() const { return ret; }
+
+private:
+  struct CallFrame {
+    const BytecodeFunction *fn;
+    const uint8_t *ip;
+    size_t base;
+    const Value::Code *closure;
+  };
+
+  struct Fork;
+
+  const BytecodeProgram &program;
+  std::vector<Val> stack;
+  std::vector<CallFrame> frames;
+  std::vector<std::unique_ptr<Fork>> forks; // not joined yet, oldest first
+  Val thunk; // the forked closure being run, nil in the main machine
+
+  // Registers, saved here while the machine is suspended
+  const BytecodeFunction *fn;
+  const uint8_t *ip;
+  size_t base = 0;
+  const Value::Code *closure = nullptr;
+  bool done = false;
+  Val ret;
+};
+
+#endif /* RUNTIME_BYTECODE_H */
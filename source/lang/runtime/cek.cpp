@@ -0,0 +1,135 @@
+#include "cek.h"
+#include "../stdlib/stdlib.h"
+#include <stdexcept>
+
+CEKMachine::CEKMachine(Term program, MachineEnv env)
+    : control(std::move(program)), env(env) {}
+
+void CEKMachine::trace(Heap &heap) const {
+  heap.mark(env);
+  heap.mark(ret);
+  for (const Frame &frame : kont) {
+    heap.mark(frame.env);
+    heap.mark(frame.value);
+  }
+}
+
+void CEKMachine::apply(const Val &fun, Val arg) {
+  switch (fun.kind()) {
+  case Val::VClosure: {
+    auto &clo = std::get<Value::Closure>(fun->payload);
+    auto &abs = std::get<TermNode::Abs>(clo.fn->payload);
+    // `_` is never referenced, so sequencing does not grow the environment
+    env = abs.param.isWildcard() ? clo.env : bind(std::move(arg), clo.env);
+    control = abs.body;
+    returning = false;
+    return;
+  }
+
+  case Val::VPrimitive: {
+    const Primitive *prim = std::get<const Primitive *>(fun->payload);
+    ret = prim->f(arg);
+    return;
+  }
+
+  default:
+    throw std::runtime_error("apply: " + stringOfValue(fun) +
+                             " is not a function");
+  }
+}
+
+bool CEKMachine::step() {
+  if (done)
+    return false;
+
+  if (!returning) {
+    switch (control->kind) {
+    case TermNode::TmUnit:
+    case TermNode::TmBool:
+    case TermNode::TmInt:
+    case TermNode::TmFloat:
+    case TermNode::TmString:
+      ret = reflect(control);
+      returning = true;
+      break;
+
+    case TermNode::TmVar: {
+      auto &var = std::get<TermNode::Var>(control->payload);
+      ret = envLookup(var.index, env);
+      if (!ret)
+        throw std::runtime_error("unbound variable " + var.name.str());
+      returning = true;
+      break;
+    }
+
+    case TermNode::TmPrim:
+      ret = Value::PrimitiveValue(
+          std::get<TermNode::Prim>(control->payload).prim);
+      returning = true;
+      break;
+
+    case TermNode::TmAbs:
+      ret = Value::ClosureValue(control, env);
+      returning = true;
+      break;
+
+    case TermNode::TmApp:
+      kont.push_back({Frame::KArg, control, env, nullptr});
+      control = std::get<TermNode::App>(control->payload).f;
+      break;
+
+    case TermNode::TmLet:
+      kont.push_back({Frame::KLet, control, env, nullptr});
+      control = std::get<TermNode::Let>(control->payload).e1;
+      break;
+
+    case TermNode::TmTuple:
+      kont.push_back({Frame::KTupleRight, control, env, nullptr});
+      control = std::get<TermNode::Tuple>(control->payload).left;
+      break;
+    }
+    return true;
+  }
+
+  if (kont.empty()) {
+    done = true;
+    return false;
+  }
+
+  Frame frame = std::move(kont.back());
+  kont.pop_back();
+
+  switch (frame.kind) {
+  case Frame::KArg:
+    kont.push_back({Frame::KApply, nullptr, nullptr, ret});
+    control = std::get<TermNode::App>(frame.term->payload).arg;
+    env = std::move(frame.env);
+    returning = false;
+    break;
+
+  case Frame::KApply:
+    apply(frame.value, std::move(ret));
+    break;
+
+  case Frame::KLet: {
+    auto &let = std::get<TermNode::Let>(frame.term->payload);
+    env = let.name.isWildcard() ? std::move(frame.env)
+                                  : bind(std::move(ret), frame.env);
+    control = let.e2;
+    returning = false;
+    break;
+  }
+
+  case Frame::KTupleRight:
+    kont.push_back({Frame::KTuple, nullptr, nullptr, ret});
+    control = std::get<TermNode::Tuple>(frame.term->payload).right;
+    env = std::move(frame.env);
+    returning = false;
+    break;
+
+  case Frame::KTuple:
+    ret = Value::TupleValue(frame.value, std::move(ret));
+    break;
+  }
+  return true;
+}
@@ -0,0 +1,56 @@
+#ifndef RUNTIME_CEK_H
+#define RUNTIME_CEK_H
+
+#include "value.h"
+#include <vector>
+
+/*
+    CEK abstract machine
+    --------------------
+    Control: the term being evaluated (or the value being returned)
+    Environment: immutable linked bindings, captured by closures and
+                 indexed by the de Bruijn indices resolve() assigned
+    Kontinuation: explicit stack of pending frames
+
+    `(fun x -> body) arg` extends the closure's environment with one binding
+    instead of rebuilding `body` through substitute()
+*/
+class CEKMachine : public GcRoots {
+public:
+  // `env` binds the variables free in `program`, as resolve() was told of
+  // them
+  explicit CEKMachine(Term program, MachineEnv env = nullptr);
+
+  // Perform one machine transition, returns false once the program halted
+  bool step();
+  // Mark the environment, the returned value and the continuation
+  void trace(Heap &heap) const override;
+
+  bool halted() const { return done; }
+  const Val &result() const { return ret; }
+
+private:
+  struct Frame {
+    enum Kind {
+      KArg,        // evaluate the argument of `term` (a TmApp) next
+      KApply,      // apply `value` to the returned argument
+      KLet,        // bind the returned value and evaluate the let body
+      KTupleRight, // evaluate the right component of `term` (a TmTuple)
+      KTuple       // pair `value` with the returned right component
+    } kind;
+    Term term;
+    MachineEnv env;
+    Val value;
+  };
+
+  void apply(const Val &fun, Val arg);
+
+  Term control;
+  MachineEnv env;
+  Val ret;
+  bool returning = false;
+  bool done = false;
+  std::vector<Frame> kont;
+};
+
+#endif /* RUNTIME_CEK_H */
@@ -0,0 +1,149 @@
+#include "gc.h"
+#include "value.h"
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+
+// Used when no program is running, never collected
+static Heap defaultHeap;
+thread_local Heap *currentHeap = &defaultHeap;
+
+// Run the destructor, the memory stays with the heap
+void Heap::release(GcObject *obj) {
+  GcObject::Type type = obj->type;
+  if (type == GcObject::ValueObject)
+    static_cast<Value *>(obj)->~Value();
+  else
+    static_cast<EnvNode *>(obj)->~EnvNode();
+  obj->nextObject = freeLists[type];
+  freeLists[type] = obj;
+}
+
+Heap::~Heap() {
+  for (GcObject *list : {young, old}) {
+    while (list) {
+      GcObject *next = list->nextObject;
+      release(list);
+      list = next;
+    }
+  }
+  for (GcObject *list : freeLists) {
+    while (list) {
+      GcObject *next = list->nextObject;
+      ::operator delete(list);
+      list = next;
+    }
+  }
+}
+
+void Heap::grey(const GcObject *obj) {
+  auto *o = const_cast<GcObject *>(obj);
+  if (o->marked || (minorOnly && o->old))
+    return;
+  o->marked = true;
+  greyStack.push_back(o);
+}
+
+void Heap::mark(const Val &v) {
+  if (v.isHeap())
+    grey(v.heap());
+}
+
+void Heap::mark(const EnvNode *env) {
+  if (env)
+    grey(env);
+}
+
+size_t Heap::sweep(GcObject *&list, bool promote) {
+  size_t kept = 0;
+  GcObject **link = &list;
+  while (GcObject *obj = *link) {
+    if (obj->marked) {
+      obj->marked = false;
+      obj->old = true;
+      kept += obj->size;
+      link = &obj->nextObject;
+    } else {
+      *link = obj->nextObject;
+      counters.freed += obj->size;
+      release(obj);
+    }
+  }
+  if (promote && list) {
+    // Splice the survivors onto the old generation
+    *link = old;
+    old = list;
+    list = nullptr;
+  }
+  return kept;
+}
+
+void Heap::collect(const GcRoots &roots, bool major) {
+  auto t0 = std::chrono::steady_clock::now();
+  counters.peak = std::max(counters.peak, live());
+  major = major || !config.nursery || live() >= majorThreshold;
+  minorOnly = !major;
+
+  roots.trace(*this);
+  if (persistent)
+    persistent->trace(*this);
+  while (!greyStack.empty()) {
+    GcObject *obj = greyStack.back();
+    greyStack.pop_back();
+    if (obj->type == GcObject::EnvObject) {
+      auto *env = static_cast<EnvNode *>(obj);
+      mark(env->value);
+      mark(env->next);
+      continue;
+    }
+    auto *v = static_cast<Value *>(obj);
+    switch (v->kind) {
+    case Val::VTuple: {
+      auto &tup = std::get<Value::Tuple>(v->payload);
+      mark(tup.left);
+      mark(tup.right);
+      break;
+    }
+    case Val::VClosure:
+      mark(std::get<Value::Closure>(v->payload).env);
+      break;
+    case Val::VCode:
+      for (const Val &c : std::get<Value::Code>(v->payload).captured)
+        mark(c);
+      break;
+    default:
+      break;
+    }
+  }
+
+  // The old generation first, the young survivors are appended to it
+  if (major)
+    oldBytes = sweep(old, false);
+  size_t promoted = sweep(young, true);
+  youngBytes = 0;
+  oldBytes += promoted;
+  if (major) {
+    counters.major++;
+  } else {
+    counters.promoted += promoted;
+    counters.minor++;
+  }
+
+  auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - t0)
+                .count();
+  counters.pauseMicros += us;
+  counters.maxPauseMicros = std::max<uint64_t>(counters.maxPauseMicros, us);
+
+  if (major) {
+    if (oldBytes > config.limit)
+      throw std::runtime_error("out of memory: " +
+                               std::to_string(oldBytes >> 10) +
+                               " kb live, heap limit is " +
+                               std::to_string(config.limit >> 10) + " kb");
+    // Let the heap grow to twice the live data before the next one
+    majorThreshold =
+        std::min(std::max(2 * oldBytes, MIN_MAJOR), config.limit);
+  }
+}
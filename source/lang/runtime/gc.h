@@ -0,0 +1,145 @@
+#ifndef RUNTIME_GC_H
+#define RUNTIME_GC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+
+class Val;
+struct EnvNode;
+class Heap;
+
+/*
+    Garbage collection
+    ------------------
+    Heap values and environment nodes are traced rather than reference
+    counted, so copying a Val is copying a word and cycles are reclaimed.
+
+    The collector is a precise mark-sweep with an optional nursery. Objects
+    are immutable once built, so an object can only point at objects older
+    than itself: a minor collection marks from the roots, stops at old
+    objects and sweeps the young ones, with no write barrier or remembered
+    set. Survivors are promoted. A major collection marks and sweeps
+    everything.
+
+    Collections only happen at safe points, where every live object is
+    reachable from a machine's roots: between CEK steps and between VM
+    instructions. Allocation in between only counts bytes
+*/
+struct GcObject {
+  enum Type : uint8_t { ValueObject, EnvObject, TYPES } type;
+  bool marked = false;
+  bool old = false; // survived a collection
+  uint32_t size = 0;
+  GcObject *nextObject = nullptr; // in the heap's list of its generation
+
+  explicit GcObject(Type type) : type(type) {}
+};
+
+// Holds references into the heap from outside it, e.g. a machine's stack
+class GcRoots {
+public:
+  virtual void trace(Heap &heap) const = 0;
+
+protected:
+  ~GcRoots() = default;
+};
+
+class Heap {
+public:
+  struct Config {
+    size_t limit = 16 << 20;    // bytes live after a major collection
+    size_t nursery = 256 << 10; // bytes between minor collections, 0: none
+  };
+  struct Stats {
+    size_t minor = 0, major = 0; // collections
+    size_t allocated = 0;        // bytes
+    size_t promoted = 0;         // bytes surviving a minor collection
+    size_t freed = 0;            // bytes
+    size_t peak = 0;             // most bytes in the heap at a collection
+    uint64_t pauseMicros = 0, maxPauseMicros = 0;
+  };
+
+  Config config;
+  // Traced by every collection besides the roots it is given, for values
+  // that outlive the machines run in this heap, e.g. a session's definitions
+  const GcRoots *persistent = nullptr;
+
+  Heap() = default;
+  Heap(const Heap &) = delete;
+  Heap &operator=(const Heap &) = delete;
+  // Frees every object, whether reachable or not
+  ~Heap();
+
+  // Objects of each type have one size, freed ones are kept for reuse
+  template <typename T, typename... Args>
+  T *make(size_t extra, Args &&...args) {
+    GcObject *&free = freeLists[T::GC_TYPE];
+    void *mem = free ? free : ::operator new(sizeof(T));
+    if (free)
+      free = free->nextObject;
+    T *obj = new (mem) T(std::forward<Args>(args)...);
+    obj->size = sizeof(T) + extra;
+    obj->nextObject = young;
+    young = obj;
+    youngBytes += obj->size;
+    counters.allocated += obj->size;
+    return obj;
+  }
+
+  bool wantsCollection() const {
+    return youngBytes + oldBytes >= majorThreshold ||
+           (config.nursery && youngBytes >= config.nursery);
+  }
+  // Collect if the allocation budget is used up. Throws if the live data
+  // does not fit the configured limit
+  void safepoint(const GcRoots &roots) {
+    if (wantsCollection())
+      collect(roots);
+  }
+  void collect(const GcRoots &roots, bool major = false);
+
+  // Called by GcRoots::trace
+  void mark(const Val &v);
+  void mark(const EnvNode *env);
+
+  size_t live() const { return youngBytes + oldBytes; }
+  const Stats &stats() const { return counters; }
+
+private:
+  static constexpr size_t MIN_MAJOR = 1 << 20;
+
+  void grey(const GcObject *obj);
+  // Free the unmarked objects of `list`, returns the bytes kept
+  size_t sweep(GcObject *&list, bool promote);
+  void release(GcObject *obj);
+
+  GcObject *young = nullptr, *old = nullptr;
+  GcObject *freeLists[GcObject::TYPES] = {};
+  size_t youngBytes = 0, oldBytes = 0;
+  size_t majorThreshold = MIN_MAJOR;
+  bool minorOnly = false;           // while marking
+  std::vector<GcObject *> greyStack; // marked, children not yet
+  Stats counters;
+};
+
+// Heap new runtime objects are allocated in, Execution::run points it at
+// the running program's heap. Per thread, tasks forked by a program run in
+// heaps of their own
+extern thread_local Heap *currentHeap;
+
+// Installs `heap` as currentHeap for its lifetime
+class HeapScope {
+public:
+  explicit HeapScope(Heap &heap) : saved(currentHeap) { currentHeap = &heap; }
+  ~HeapScope() { currentHeap = saved; }
+  HeapScope(const HeapScope &) = delete;
+  HeapScope &operator=(const HeapScope &) = delete;
+
+private:
+  Heap *saved;
+};
+
+#endif /* RUNTIME_GC_H */
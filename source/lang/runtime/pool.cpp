@@ -0,0 +1,167 @@
+#include "pool.h"
+#include <algorithm>
+
+// The 3DS build has no threads to run tasks on
+#ifndef __3DS__
+#define POOL_THREADS 1
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#endif
+
+static unsigned configuredWorkers = ~0u;
+
+void TaskPool::configure(unsigned workers) { configuredWorkers = workers; }
+
+TaskPool &TaskPool::shared() {
+#ifdef POOL_THREADS
+  unsigned cores = std::max(std::thread::hardware_concurrency(), 1u);
+  static TaskPool pool(configuredWorkers != ~0u ? configuredWorkers
+                                                : cores - 1);
+#else
+  static TaskPool pool(0);
+#endif
+  return pool;
+}
+
+#ifdef POOL_THREADS
+
+struct TaskPool::Queue {
+  std::mutex lock;
+  std::deque<Task *> tasks;
+};
+
+struct TaskPool::Threads {
+  std::vector<std::thread> workers;
+  std::mutex sleepLock;
+  std::condition_variable wake;
+  std::atomic<size_t> queued{0};
+  bool stopping = false; // under sleepLock
+};
+
+// Queue index of the calling thread in the pool it works for
+static thread_local const TaskPool *workerOf = nullptr;
+static thread_local size_t workerQueue = 0;
+
+TaskPool::TaskPool(unsigned workers) : nworkers(workers) {
+  for (unsigned i = 0; i <= workers; i++)
+    queues.push_back(std::make_unique<Queue>());
+  if (workers == 0)
+    return;
+  threads = std::make_unique<Threads>();
+  for (unsigned i = 1; i <= workers; i++)
+    threads->workers.emplace_back([this, i] { work(i); });
+}
+
+TaskPool::~TaskPool() {
+  if (!threads)
+    return;
+  {
+    std::lock_guard<std::mutex> guard(threads->sleepLock);
+    threads->stopping = true;
+  }
+  threads->wake.notify_all();
+  for (auto &t : threads->workers)
+    t.join();
+}
+
+size_t TaskPool::queueOf() const {
+  return workerOf == this ? workerQueue : 0;
+}
+
+void TaskPool::spawn(Task &task) {
+  if (!threads) {
+    task.run();
+    task.done.store(true, std::memory_order_release);
+    return;
+  }
+  Queue &q = *queues[queueOf()];
+  {
+    std::lock_guard<std::mutex> guard(q.lock);
+    q.tasks.push_back(&task);
+  }
+  {
+    // Taken so a worker cannot miss the wake up between checking the count
+    // and going to sleep
+    std::lock_guard<std::mutex> guard(threads->sleepLock);
+    threads->queued++;
+  }
+  threads->wake.notify_one();
+}
+
+TaskPool::Task *TaskPool::take(size_t self) {
+  {
+    Queue &own = *queues[self];
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (!own.tasks.empty()) {
+      Task *task = own.tasks.back();
+      own.tasks.pop_back();
+      threads->queued--;
+      return task;
+    }
+  }
+  for (size_t i = 1; i < queues.size(); i++) {
+    Queue &victim = *queues[(self + i) % queues.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.tasks.empty()) {
+      Task *task = victim.tasks.front();
+      victim.tasks.pop_front();
+      threads->queued--;
+      return task;
+    }
+  }
+  return nullptr;
+}
+
+void TaskPool::work(size_t self) {
+  workerOf = this;
+  workerQueue = self;
+  while (true) {
+    if (Task *task = take(self)) {
+      task->run();
+      task->done.store(true, std::memory_order_release);
+      continue;
+    }
+    std::unique_lock<std::mutex> guard(threads->sleepLock);
+    threads->wake.wait(guard, [this] {
+      return threads->stopping || threads->queued > 0;
+    });
+    if (threads->stopping)
+      return;
+  }
+}
+
+void TaskPool::join(Task &task) {
+  size_t self = queueOf();
+  while (!task.done.load(std::memory_order_acquire)) {
+    if (Task *other = take(self)) {
+      other->run();
+      other->done.store(true, std::memory_order_release);
+    } else {
+      // `task` is running on another thread
+      std::this_thread::yield();
+    }
+  }
+}
+
+#else
+
+struct TaskPool::Queue {};
+struct TaskPool::Threads {};
+
+TaskPool::TaskPool(unsigned) : nworkers(0) {}
+TaskPool::~TaskPool() = default;
+
+size_t TaskPool::queueOf() const { return 0; }
+
+void TaskPool::spawn(Task &task) {
+  task.run();
+  task.done.store(true, std::memory_order_release);
+}
+
+TaskPool::Task *TaskPool::take(size_t) { return nullptr; }
+void TaskPool::work(size_t) {}
+void TaskPool::join(Task &) {}
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef RUNTIME_POOL_H
+#define RUNTIME_POOL_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+/*
+    Work-stealing pool
+    ------------------
+    Runs tasks forked by programs on the host's other cores. Each worker
+    thread has its own queue: it pushes and pops at the back, and an idle
+    worker steals from the front of the others', which hold the oldest and
+    usually largest tasks. Threads outside the pool push to a queue of
+    their own that workers steal from too.
+
+    A thread joining a task runs queued tasks until that one is done, so a
+    task may fork and join in turn without tying up its thread. Without
+    threads (the 3DS build, or zero workers) spawn() runs the task on the
+    spot
+*/
+class TaskPool {
+public:
+  class Task {
+  public:
+    virtual ~Task() = default;
+    // Must not throw, errors are kept for whoever joins
+    virtual void run() noexcept = 0;
+
+  private:
+    friend class TaskPool;
+    std::atomic<bool> done{false};
+  };
+
+  // Threads besides the caller's, set before the first call to shared()
+  static void configure(unsigned workers);
+  // One worker per core besides the caller's unless configured otherwise
+  static TaskPool &shared();
+
+  explicit TaskPool(unsigned workers);
+  ~TaskPool();
+  TaskPool(const TaskPool &) = delete;
+  TaskPool &operator=(const TaskPool &) = delete;
+
+  unsigned workers() const { return nworkers; }
+
+  // Queue `task`, which must outlive its join()
+  void spawn(Task &task);
+  // Return once `task` has run, running queued tasks meanwhile
+  void join(Task &task);
+
+private:
+  struct Queue;
+  struct Threads;
+
+  // A queued task, the caller's own queue first, nullptr if there is none
+  Task *take(size_t self);
+  // The calling thread's queue
+  size_t queueOf() const;
+  void work(size_t self);
+
+  unsigned nworkers;
+  std::vector<std::unique_ptr<Queue>> queues; // queues[0]: outside threads
+  std::unique_ptr<Threads> threads;
+};
+
+#endif /* RUNTIME_POOL_H */
@@ -0,0 +1,107 @@
+#include "rope.h"
+#include <algorithm>
+#include <vector>
+
+// Results up to this size are copied into a leaf rather than shared
+static constexpr size_t SHORT = 64;
+
+Rope::Rope(std::string text)
+    : node(text.empty() ? nullptr : new Node(std::move(text))) {}
+
+Rope Rope::concat(const Rope &left, const Rope &right) {
+  if (left.empty())
+    return right;
+  if (right.empty())
+    return left;
+  size_t length = left.size() + right.size();
+  if (length <= SHORT) {
+    std::string text;
+    text.reserve(length);
+    text.append(left.view()).append(right.view());
+    return Rope(std::move(text));
+  }
+
+  // Appending to a rope that ends in a short leaf merges the two, so a
+  // string built a piece at a time keeps leaves of about SHORT bytes
+  const Node *l = left.node.get();
+  if (l->kind == Node::Concat && l->right->length + right.size() <= SHORT) {
+    Rope tail = concat(Rope(l->right.get()), right);
+    return Rope(new Node(Node::Concat, length, l->left, tail.node, 0));
+  }
+  return Rope(new Node(Node::Concat, length, left.node, right.node, 0));
+}
+
+Rope Rope::sub(size_t pos, size_t length) const {
+  pos = std::min(pos, size());
+  length = std::min(length, size() - pos);
+  if (length == size())
+    return *this;
+  if (length <= SHORT)
+    return Rope(std::string(view().substr(pos, length)));
+
+  // Slices always point at a leaf, flattening a concatenation first
+  view();
+  if (node->kind == Node::Slice)
+    return Rope(new Node(Node::Slice, length, node->left, nullptr,
+                         node->offset + pos));
+  return Rope(new Node(Node::Slice, length, node, nullptr, pos));
+}
+
+size_t Rope::size() const { return node ? node->length : 0; }
+
+std::string_view Rope::view() const {
+  if (!node)
+    return {};
+  if (node->kind == Node::Concat)
+    node->flatten();
+  if (node->kind == Node::Slice)
+    return std::string_view(node->left->text).substr(node->offset,
+                                                     node->length);
+  return node->text;
+}
+
+void Rope::Node::flatten() {
+  std::string out;
+  out.reserve(length);
+  std::vector<const Node *> stack{this};
+  while (!stack.empty()) {
+    const Node *n = stack.back();
+    stack.pop_back();
+    switch (n->kind) {
+    case Leaf:
+      out += n->text;
+      break;
+    case Slice:
+      out.append(n->left->text, n->offset, n->length);
+      break;
+    case Concat:
+      stack.push_back(n->right.get());
+      stack.push_back(n->left.get());
+      break;
+    }
+  }
+  kind = Leaf;
+  text = std::move(out);
+  left = nullptr;
+  right = nullptr;
+}
+
+Rope::Node::~Node() {
+  // Same scheme as ~TermNode(): children that would die with this node are
+  // released by the outermost destructor in a loop
+  static thread_local std::vector<Ref<Node>> pending;
+  static thread_local bool draining = false;
+
+  for (Ref<Node> *child : {&left, &right})
+    if (*child && child->use_count() == 1)
+      pending.push_back(std::move(*child));
+
+  if (draining)
+    return;
+  draining = true;
+  while (!pending.empty()) {
+    Ref<Node> n = std::move(pending.back());
+    pending.pop_back();
+  }
+  draining = false;
+}
@@ -0,0 +1,63 @@
+#ifndef RUNTIME_ROPE_H
+#define RUNTIME_ROPE_H
+
+#include "../ref.h"
+#include <string>
+#include <string_view>
+
+/*
+    Ropes
+    -----
+    Runtime strings. A rope is a shared, immutable tree: leaves own flat
+    text, inner nodes are the concatenation of two ropes or a slice of a
+    flat one. Concatenating and slicing share their operands instead of
+    copying them, short results are copied into a leaf so small strings
+    do not pay for a tree.
+
+    The text is flattened the first time it is needed contiguous, by a
+    print for instance, and the node then becomes a leaf holding it, so a
+    string printed repeatedly is only assembled once
+*/
+class Rope {
+public:
+  Rope() = default;
+  Rope(std::string text);
+
+  static Rope concat(const Rope &left, const Rope &right);
+  // The `length` bytes from `pos`, clamped to the string
+  Rope sub(size_t pos, size_t length) const;
+
+  size_t size() const;
+  bool empty() const { return size() == 0; }
+
+  // The text, valid as long as the rope
+  std::string_view view() const;
+  std::string str() const { return std::string(view()); }
+
+private:
+  struct Node : RefCounted {
+    enum Kind { Leaf, Concat, Slice } kind;
+    size_t length;
+    std::string text;      // Leaf
+    Ref<Node> left, right; // Concat: both halves, Slice: the leaf in left
+    size_t offset = 0;     // Slice
+
+    Node(std::string text)
+        : kind(Leaf), length(text.size()), text(std::move(text)) {}
+    Node(Kind kind, size_t length, Ref<Node> left, Ref<Node> right,
+         size_t offset)
+        : kind(kind), length(length), left(std::move(left)),
+          right(std::move(right)), offset(offset) {}
+    // Releases children iteratively, ropes built in a loop are deep
+    ~Node();
+
+    // Turn a concatenation into a leaf holding its text
+    void flatten();
+  };
+
+  explicit Rope(Node *node) : node(node) {}
+
+  Ref<Node> node; // null for the empty string
+};
+
+#endif /* RUNTIME_ROPE_H */
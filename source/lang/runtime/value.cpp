@@ -0,0 +1,146 @@
+#include "value.h"
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+MachineEnv bind(Val v, MachineEnv env) {
+  return currentHeap->make<EnvNode>(0, v, env);
+}
+
+Val envLookup(int index, const MachineEnv &env) {
+  if (index < 0)
+    return nullptr;
+  const EnvNode *e = env;
+  for (; e && index > 0; index--)
+    e = e->next;
+  return e ? e->value : nullptr;
+}
+
+Val reflect(const Term &data) {
+  switch (data->kind) {
+  case TermNode::TmUnit:
+    return Val::Unit();
+  case TermNode::TmBool:
+    return Val::Bool(std::get<bool>(data->payload));
+  case TermNode::TmInt:
+    return Val::Int(std::get<int>(data->payload));
+  case TermNode::TmFloat:
+    return Val::Float(std::get<double>(data->payload));
+  case TermNode::TmString:
+    return Value::StringValue(std::get<std::string>(data->payload));
+  case TermNode::TmTuple: {
+    auto &tup = std::get<TermNode::Tuple>(data->payload);
+    return Value::TupleValue(reflect(tup.left), reflect(tup.right));
+  }
+  default:
+    throw std::runtime_error("reflect: " + stringOfTerm(data) +
+                             " is not a value");
+  }
+}
+
+Term reify(const Val &v) {
+  switch (v.kind()) {
+  case Val::VUnit:
+    return TermNode::Unit();
+  case Val::VBool:
+    return TermNode::Bool(v.asBool());
+  case Val::VInt:
+    return TermNode::Int(v.asInt());
+  case Val::VFloat:
+    return TermNode::Float(v.asFloat());
+  case Val::VString:
+    return TermNode::String(std::get<Rope>(v->payload).str());
+  case Val::VTuple: {
+    auto &tup = std::get<Value::Tuple>(v->payload);
+    return TermNode::TupleTerm(reify(tup.left), reify(tup.right));
+  }
+  case Val::VClosure: {
+    // A closure of no environment is closed, as the substitution engine's
+    // functions are
+    auto &clo = std::get<Value::Closure>(v->payload);
+    if (!clo.env)
+      return clo.fn;
+    [[fallthrough]];
+  }
+  default:
+    throw std::runtime_error("reify: functional value cannot be passed to a "
+                             "primitive");
+  }
+}
+
+// Spelled as stringOfTerm spells literals, without building terms, so
+// machines on other threads can report errors
+std::string stringOfValue(const Val &v) {
+  std::ostringstream out;
+  switch (v.kind()) {
+  case Val::VNil:
+    return "<nil>";
+  case Val::VUnit:
+    return "()";
+  case Val::VBool:
+    return v.asBool() ? "true" : "false";
+  case Val::VInt:
+    return std::to_string(v.asInt());
+  case Val::VFloat:
+    out << v.asFloat();
+    return out.str();
+  case Val::VString:
+    return "\"" + std::get<Rope>(v->payload).str() + "\"";
+  case Val::VTuple: {
+    auto &tup = std::get<Value::Tuple>(v->payload);
+    return "(" + stringOfValue(tup.left) + ", " + stringOfValue(tup.right) +
+           ")";
+  }
+  case Val::VClosure:
+  case Val::VCode:
+    return "<fun>";
+  case Val::VPrimitive:
+    return "<primitive>";
+  }
+  return "<nil>";
+}
+
+static Val copyValue(const Val &v,
+                     std::unordered_map<const Value *, Val> &copies) {
+  if (!v.isHeap())
+    return v;
+  auto it = copies.find(v.heap());
+  if (it != copies.end())
+    return it->second;
+
+  Val out;
+  switch (v.kind()) {
+  case Val::VString:
+    out = Value::StringValue(std::get<Rope>(v->payload).str());
+    break;
+  case Val::VTuple: {
+    auto &tup = std::get<Value::Tuple>(v->payload);
+    Val left = copyValue(tup.left, copies);
+    out = Value::TupleValue(left, copyValue(tup.right, copies));
+    break;
+  }
+  case Val::VPrimitive:
+    out = Value::PrimitiveValue(std::get<const Primitive *>(v->payload));
+    break;
+  case Val::VCode: {
+    auto &code = std::get<Value::Code>(v->payload);
+    std::vector<Val> captured;
+    captured.reserve(code.captured.size());
+    for (const Val &c : code.captured)
+      captured.push_back(copyValue(c, copies));
+    out = Value::CodeValue(code.fn, std::move(captured));
+    break;
+  }
+  default:
+    throw std::runtime_error("copyValue: " + stringOfValue(v) +
+                             " cannot leave its heap");
+  }
+  // Shared parts stay shared
+  copies.emplace(v.heap(), out);
+  return out;
+}
+
+Val copyValue(const Val &v) {
+  std::unordered_map<const Value *, Val> copies;
+  return copyValue(v, copies);
+}
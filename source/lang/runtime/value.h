@@ -0,0 +1,212 @@
+#ifndef RUNTIME_VALUE_H
+#define RUNTIME_VALUE_H
+
+#include "../syntax.h"
+#include "gc.h"
+#include "rope.h"
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+struct Value;
+struct EnvNode;
+struct BytecodeFunction;
+struct Primitive;
+
+/*
+    Runtime values
+    --------------
+    A Val is one NaN-boxed 64-bit word. Floats are stored as themselves
+    (NaNs canonicalized to a positive quiet NaN), everything else lives in
+    the payload of a negative quiet NaN:
+
+    0xFFF9 0000 0000 0000       nil (no value)
+    0xFFFA 0000 0000 0000       unit
+    0xFFFB 0000 0000 000b       bool
+    0xFFFC 0000 iiii iiii       int
+    0xFFFD pppp pppp pppp       pointer to a heap Value
+
+    Only strings, tuples and functions are allocated, in the heap of the
+    running program (runtime/gc.h), which traces them. A Val is a plain
+    word, copying one costs nothing. Strings are ropes (runtime/rope.h), so
+    concatenation shares its operands
+*/
+class Val {
+public:
+  enum Kind {
+    VNil,
+    VUnit,
+    VBool,
+    VInt,
+    VFloat,
+    VString,
+    VTuple,
+    VClosure,
+    VPrimitive,
+    VCode
+  };
+
+  Val() : bits(TAG_NIL) {}
+  Val(std::nullptr_t) : Val() {}
+
+  // ---- Immediates ----
+  static Val Unit() { return Val(TAG_UNIT); }
+  static Val Bool(bool b) { return Val(TAG_BOOL | b); }
+  static Val Int(int i) { return Val(TAG_INT | static_cast<uint32_t>(i)); }
+  static Val Float(double d) {
+    uint64_t b;
+    std::memcpy(&b, &d, sizeof b);
+    // NaNs tested on the bits, -ffast-math may fold `d != d` to false
+    bool nan = (b & EXPONENT_MASK) == EXPONENT_MASK && (b & MANTISSA_MASK);
+    return Val(nan ? CANONICAL_NAN : b);
+  }
+
+  // Refer to a heap value
+  static Val Heap(const Value *v);
+
+  Kind kind() const;
+  explicit operator bool() const { return bits != TAG_NIL; }
+  bool isHeap() const { return (bits & TAG_MASK) == TAG_HEAP; }
+
+  bool asBool() const { return bits & 1; }
+  int asInt() const { return static_cast<int32_t>(bits & 0xFFFFFFFF); }
+  double asFloat() const {
+    double d;
+    std::memcpy(&d, &bits, sizeof d);
+    return d;
+  }
+  const Value *heap() const {
+    return reinterpret_cast<const Value *>(
+        static_cast<uintptr_t>(bits & PAYLOAD_MASK));
+  }
+  const Value *operator->() const { return heap(); }
+
+private:
+  static constexpr uint64_t TAG_MASK = 0xFFFF000000000000ull;
+  static constexpr uint64_t PAYLOAD_MASK = 0x0000FFFFFFFFFFFFull;
+  static constexpr uint64_t TAG_NIL = 0xFFF9000000000000ull;
+  static constexpr uint64_t TAG_UNIT = 0xFFFA000000000000ull;
+  static constexpr uint64_t TAG_BOOL = 0xFFFB000000000000ull;
+  static constexpr uint64_t TAG_INT = 0xFFFC000000000000ull;
+  static constexpr uint64_t TAG_HEAP = 0xFFFD000000000000ull;
+  static constexpr uint64_t CANONICAL_NAN = 0x7FF8000000000000ull;
+  static constexpr uint64_t EXPONENT_MASK = 0x7FF0000000000000ull;
+  static constexpr uint64_t MANTISSA_MASK = 0x000FFFFFFFFFFFFFull;
+
+  explicit Val(uint64_t bits) : bits(bits) {}
+
+  uint64_t bits;
+};
+
+static_assert(sizeof(Val) == 8, "Val must stay a single 64-bit word");
+static_assert(std::is_trivially_copyable_v<Val>, "Vals are not counted");
+
+using MachineEnv = const EnvNode *;
+
+// One binding of a machine environment. Environments are immutable linked
+// lists, so extending one is a single allocation and closures share the tail.
+// Bindings are anonymous, a variable reaches its value through its de Bruijn
+// index
+struct EnvNode : GcObject {
+  static constexpr Type GC_TYPE = EnvObject;
+  Val value;
+  MachineEnv next;
+
+  EnvNode(Val value, MachineEnv next)
+      : GcObject(EnvObject), value(value), next(next) {}
+};
+
+// Heap-allocated runtime values
+struct Value : GcObject {
+  static constexpr Type GC_TYPE = ValueObject;
+  Val::Kind kind;
+
+  struct Tuple {
+    Val left, right;
+  };
+  struct Closure {
+    Term fn; // the TmAbs node
+    MachineEnv env;
+  };
+  // Closure of the bytecode VM, captured values are copied in
+  struct Code {
+    const BytecodeFunction *fn;
+    std::vector<Val> captured;
+  };
+
+  using Payload =
+      std::variant<Rope, Tuple, Closure, const Primitive *, Code>;
+  Payload payload;
+
+  Value(Val::Kind kind, Payload payload)
+      : GcObject(ValueObject), kind(kind), payload(std::move(payload)) {}
+
+  // ---- Factory functions ----
+  // The text of a string is shared by ropes and not counted against the
+  // heap, only the string object is
+  static Val StringValue(Rope s) {
+    return make(0, Val::VString, std::move(s));
+  }
+  static Val TupleValue(Val a, Val b) {
+    return make(0, Val::VTuple, Tuple{a, b});
+  }
+  static Val ClosureValue(Term fn, MachineEnv env) {
+    return make(0, Val::VClosure, Closure{std::move(fn), env});
+  }
+  static Val PrimitiveValue(const Primitive *p) {
+    return make(0, Val::VPrimitive, p);
+  }
+  static Val CodeValue(const BytecodeFunction *fn, std::vector<Val> captured) {
+    size_t extra = captured.size() * sizeof(Val);
+    return make(extra, Val::VCode, Code{fn, std::move(captured)});
+  }
+
+private:
+  static Val make(size_t extra, Val::Kind kind, Payload payload) {
+    return Val::Heap(
+        currentHeap->make<Value>(extra, kind, std::move(payload)));
+  }
+};
+
+inline Val Val::Heap(const Value *v) {
+  return Val(TAG_HEAP | static_cast<uint64_t>(reinterpret_cast<uintptr_t>(v)));
+}
+
+inline Val::Kind Val::kind() const {
+  switch (bits & TAG_MASK) {
+  case TAG_NIL:
+    return VNil;
+  case TAG_UNIT:
+    return VUnit;
+  case TAG_BOOL:
+    return VBool;
+  case TAG_INT:
+    return VInt;
+  case TAG_HEAP:
+    return heap()->kind;
+  default:
+    return VFloat;
+  }
+}
+
+MachineEnv bind(Val v, MachineEnv env);
+// The value `index` bindings up `env`, nil if there is none
+Val envLookup(int index, const MachineEnv &env);
+
+// Conversions between values and literal terms, used for program constants
+// and by the substitution-based engine
+Val reflect(const Term &data);
+Term reify(const Val &v);
+
+std::string stringOfValue(const Val &v);
+
+// A copy of `v` in the current heap, for moving values between the heaps of
+// different threads. Strings are copied flat rather than shared, as ropes
+// are not counted atomically. Closures of the CEK machine hold terms and
+// cannot be copied
+Val copyValue(const Val &v);
+
+#endif /* RUNTIME_VALUE_H */
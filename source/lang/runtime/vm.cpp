@@ -0,0 +1,296 @@
+#include "bytecode.h"
+#include "../stdlib/stdlib.h"
+#include "pool.h"
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+
+// Direct-threaded dispatch needs the labels-as-values extension
+#if defined(__GNUC__) || defined(__clang__)
+#define THREADED_DISPATCH 1
+#endif
+
+/*
+    A forked function, run to completion by a VM of its own in a heap of its
+    own. Its captured values are copied into that heap when it is forked and
+    its result out of it when it is joined, so threads never share objects
+*/
+struct VM::Fork : TaskPool::Task {
+  const BytecodeProgram &program;
+  size_t slot; // of the placeholder on the forking machine's stack
+  Heap heap;
+  Val thunk;
+  Val result;
+  std::exception_ptr error;
+
+  Fork(const BytecodeProgram &program, const BytecodeFunction *fn,
+       const Val *captured, size_t n, size_t slot)
+      : program(program), slot(slot) {
+    heap.config = currentHeap->config;
+    HeapScope scope(heap);
+    std::vector<Val> copies;
+    for (size_t i = 0; i < n; i++)
+      copies.push_back(copyValue(captured[i]));
+    thunk = Value::CodeValue(fn, std::move(copies));
+  }
+
+  void run() noexcept override {
+    HeapScope scope(heap);
+    try {
+      result = VM(program, thunk).run();
+    } catch (...) {
+      error = std::current_exception();
+    }
+  }
+};
+
+VM::VM(const BytecodeProgram &program, const std::vector<Val> &inputs)
+    : program(program), fn(&program.functions[0]), ip(fn->code.data()) {
+  stack.resize(fn->nlocals);
+  std::copy(inputs.begin(), inputs.end(), stack.begin());
+}
+
+VM::VM(const BytecodeProgram &program, Val thunk)
+    : program(program), thunk(thunk) {
+  closure = &std::get<Value::Code>(thunk->payload);
+  fn = closure->fn;
+  ip = fn->code.data();
+  stack.resize(fn->nlocals);
+}
+
+VM::~VM() {
+  for (auto &fork : forks)
+    TaskPool::shared().join(*fork);
+}
+
+void VM::trace(Heap &heap) const {
+  for (const Val &v : stack)
+    heap.mark(v);
+  if (thunk)
+    heap.mark(thunk);
+  else
+    for (auto &f : program.functions)
+      for (const Val &v : f.constants)
+        heap.mark(v);
+  heap.mark(ret);
+}
+
+Val VM::run() {
+  while (run(SIZE_MAX))
+    ;
+  return ret;
+}
+
+bool VM::run(size_t fuel) {
+  if (done)
+    return false;
+
+  // Work on local copies of the registers, written back when fuel runs out
+  const BytecodeFunction *fn = this->fn;
+  const uint8_t *ip = this->ip;
+  const Value::Code *closure = this->closure;
+  size_t base = this->base;
+
+#define READ_U16() (ip += 2, static_cast<uint16_t>(ip[-2] | ip[-1] << 8))
+#define POP() (stack.pop_back())
+// Instructions that allocate end in a safe point, everything live is on the
+// stack there
+#define SAFEPOINT() currentHeap->safepoint(*this)
+
+#ifdef THREADED_DISPATCH
+  static void *const dispatch[OP_COUNT] = {
+      &&L_OP_CONST, &&L_OP_LOCAL,   &&L_OP_SETLOCAL, &&L_OP_UPVAL,
+      &&L_OP_PRIM,  &&L_OP_CALLPRIM, &&L_OP_CALLPRIM2, &&L_OP_CLOSURE,
+      &&L_OP_TUPLE, &&L_OP_APPLY,    &&L_OP_FORK,      &&L_OP_JOIN,
+      &&L_OP_POP,   &&L_OP_RETURN,   &&L_OP_HALT};
+#define CASE(op) L_##op:
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    if (fuel-- == 0)                                                           \
+      goto out_of_fuel;                                                        \
+    goto *dispatch[*ip++];                                                     \
+  } while (0)
+  DISPATCH();
+#else
+#define CASE(op) case op:
+#define DISPATCH() continue
+  for (;;) {
+    if (fuel-- == 0)
+      goto out_of_fuel;
+    switch (*ip++) {
+#endif
+
+  CASE(OP_CONST) {
+    const Val &k = fn->constants[READ_U16()];
+    if (thunk && k.isHeap()) {
+      // Strings of the forking machine's heap, a fork works on copies
+      stack.push_back(copyValue(k));
+      SAFEPOINT();
+      DISPATCH();
+    }
+    stack.push_back(k);
+    DISPATCH();
+  }
+
+  CASE(OP_LOCAL) {
+    uint16_t slot = READ_U16();
+    stack.push_back(stack[base + slot]);
+    DISPATCH();
+  }
+
+  CASE(OP_SETLOCAL) {
+    uint16_t slot = READ_U16();
+    stack[base + slot] = std::move(stack.back());
+    POP();
+    DISPATCH();
+  }
+
+  CASE(OP_UPVAL) {
+    stack.push_back(closure->captured[READ_U16()]);
+    DISPATCH();
+  }
+
+  CASE(OP_PRIM) {
+    stack.push_back(Value::PrimitiveValue(&primitive_list[READ_U16()].second));
+    SAFEPOINT();
+    DISPATCH();
+  }
+
+  CASE(OP_CALLPRIM) {
+    const Primitive &prim = primitive_list[READ_U16()].second;
+    stack.back() = prim.f(stack.back());
+    SAFEPOINT();
+    DISPATCH();
+  }
+
+  CASE(OP_CALLPRIM2) {
+    const Primitive &prim = primitive_list[READ_U16()].second;
+    Val right = std::move(stack.back());
+    POP();
+    stack.back() = prim.f2(stack.back(), right);
+    SAFEPOINT();
+    DISPATCH();
+  }
+
+  CASE(OP_CLOSURE) {
+    const BytecodeFunction *target = fn + READ_U16();
+    uint16_t n = READ_U16();
+    std::vector<Val> captured(std::make_move_iterator(stack.end() - n),
+                              std::make_move_iterator(stack.end()));
+    stack.resize(stack.size() - n);
+    stack.push_back(Value::CodeValue(target, std::move(captured)));
+    SAFEPOINT();
+    DISPATCH();
+  }
+
+  CASE(OP_TUPLE) {
+    Val right = std::move(stack.back());
+    POP();
+    stack.back() = Value::TupleValue(stack.back(), right);
+    SAFEPOINT();
+    DISPATCH();
+  }
+
+  CASE(OP_APPLY) {
+    Val arg = std::move(stack.back());
+    POP();
+    Val fun = std::move(stack.back());
+    POP();
+
+    if (fun.kind() == Val::VPrimitive) {
+      const Primitive *prim = std::get<const Primitive *>(fun->payload);
+      stack.push_back(prim->f(arg));
+      SAFEPOINT();
+      DISPATCH();
+    }
+    if (fun.kind() != Val::VCode)
+      throw std::runtime_error("apply: " + stringOfValue(fun) +
+                               " is not a function");
+
+    frames.push_back({fn, ip, base, closure});
+    closure = &std::get<Value::Code>(fun->payload);
+    fn = closure->fn;
+    ip = fn->code.data();
+    base = stack.size();
+    stack.push_back(std::move(arg));
+    stack.resize(base + fn->nlocals);
+    // Keep the closure alive while its frame runs
+    stack.push_back(std::move(fun));
+    DISPATCH();
+  }
+
+  CASE(OP_FORK) {
+    const BytecodeFunction *target = fn + READ_U16();
+    uint16_t n = READ_U16();
+    size_t slot = stack.size() - n;
+    forks.push_back(
+        std::make_unique<Fork>(program, target, &stack[slot], n, slot));
+    stack.resize(slot);
+    stack.push_back(nullptr);
+    TaskPool::shared().spawn(*forks.back());
+    DISPATCH();
+  }
+
+  CASE(OP_JOIN) {
+    size_t first = forks.size() - READ_U16();
+    for (size_t i = first; i < forks.size(); i++)
+      TaskPool::shared().join(*forks[i]);
+    // Errors in evaluation order, as if the forks had run in sequence
+    for (size_t i = first; i < forks.size(); i++) {
+      if (std::exception_ptr error = forks[i]->error) {
+        forks.resize(first);
+        std::rethrow_exception(error);
+      }
+    }
+    for (size_t i = first; i < forks.size(); i++)
+      stack[forks[i]->slot] = copyValue(forks[i]->result);
+    forks.resize(first);
+    SAFEPOINT();
+    DISPATCH();
+  }
+
+  CASE(OP_POP) {
+    POP();
+    DISPATCH();
+  }
+
+  CASE(OP_RETURN) {
+    Val result = std::move(stack.back());
+    stack.resize(base);
+    CallFrame &caller = frames.back();
+    fn = caller.fn;
+    ip = caller.ip;
+    base = caller.base;
+    closure = caller.closure;
+    frames.pop_back();
+    stack.push_back(std::move(result));
+    DISPATCH();
+  }
+
+  CASE(OP_HALT) {
+    ret = stack.size() > fn->nlocals ? stack.back() : nullptr;
+    stack.clear();
+    done = true;
+    return false;
+  }
+
+#ifndef THREADED_DISPATCH
+  default:
+    throw std::runtime_error("vm: bad opcode");
+    }
+  }
+#endif
+
+out_of_fuel:
+  this->fn = fn;
+  this->ip = ip;
+  this->closure = closure;
+  this->base = base;
+  return true;
+
+#undef CASE
+#undef DISPATCH
+#undef SAFEPOINT
+#undef POP
+#undef READ_U16
+}
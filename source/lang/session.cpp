@@ -0,0 +1,408 @@
+#include "session.h"
+#include "image.h"
+#include "mapped.h"
+#include "parser/driver.hpp"
+#include "runtime/bytecode.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <unordered_set>
+
+#ifdef __3DS__
+#include "../Notepad3DS/source/display.h"
+#endif
+
+Session::Session(Engine engine, std::ostream &diagnostics)
+    : engine(engine), context(diagnostics) {
+  gc.persistent = this;
+}
+
+Session::~Session() {
+  // The running phrase's machine points into the heap
+  running.reset();
+}
+
+void Session::trace(Heap &heap) const {
+  for (auto &[name, def] : definitions) {
+    heap.mark(def.value);
+    for (auto &program : def.programs)
+      for (auto &fn : program->functions)
+        for (const Val &v : fn.constants)
+          heap.mark(v);
+  }
+}
+
+void Session::submit(std::string phrase) { pending.push_back(phrase); }
+
+void Session::load(const std::string &source) {
+  std::vector<std::string> phrases = splitPhrases(source);
+  size_t same = 0;
+  while (same < history.size() && same < phrases.size() &&
+         history[same] == phrases[same])
+    same++;
+  if (same < history.size() || history.empty()) {
+    reset();
+    same = 0;
+    DO_3DS(clear_top_screen());
+  }
+  running.reset();
+  pending.assign(phrases.begin() + same, phrases.end());
+
+  loads++;
+  for (auto it = parsed.begin(); it != parsed.end();)
+    it = it->second.used + 1 < loads ? parsed.erase(it) : std::next(it);
+  for (auto it = cache.begin(); it != cache.end();)
+    it = it->second.used + 1 < loads ? cache.erase(it) : std::next(it);
+}
+
+void Session::cancel() {
+  running.reset();
+  pending.clear();
+}
+
+void Session::reset() {
+  cancel();
+  history.clear();
+  definitions.clear();
+}
+
+static void reportError(Context &context, const std::string &message) {
+#ifdef __3DS__
+  status_message(message);
+#else
+  context.diagnostics() << message << std::endl;
+#endif
+}
+
+// A step of FNV-1a over a whole key
+static uint64_t mixKey(uint64_t h, uint64_t key) {
+  return (h ^ key) * 0x100000001b3ull + (h >> 29);
+}
+
+const Session::Parsed *Session::parse(const std::string &text, bool term) {
+  auto it = parsed.find(text);
+  if (it != parsed.end() && (it->second.term || !term)) {
+    it->second.used = loads;
+    return &it->second;
+  }
+
+  MC::MC_Driver driver;
+  driver.errors = &context.diagnostics();
+  if (driver.parse(std::string_view(text)))
+    return nullptr;
+  // Primitives are free too, whether a definition shadows one is part of
+  // the key
+  static const PrimitiveTable none;
+  Parsed &p = parsed[text];
+  p.term = std::move(driver.root_term);
+  p.definition = driver.definition;
+  p.free = freeVariables(resolve(p.term, none));
+  p.used = loads;
+  return &p;
+}
+
+bool Session::compile(const Parsed &phrase, const std::vector<Symbol> &outer,
+                      const Definitions &scope, Compiled &out) {
+  // Definitions shadow the primitives they are named after
+  const PrimitiveTable &primitives = context.primitives();
+  const PrimitiveTable *visible = &primitives;
+  PrimitiveTable unshadowed;
+  for (Symbol name : outer)
+    if (primitives.count(name)) {
+      if (visible == &primitives)
+        unshadowed = primitives, visible = &unshadowed;
+      unshadowed.erase(name);
+    }
+
+  Term prog = primitiveArgs(phrase.term, *visible);
+  prog = resolve(prog, *visible, outer);
+  EnvType types;
+  for (Symbol name : outer)
+    types.push_back(scope.at(name).type);
+  try {
+    prog = typecheck(prog, context, types);
+  } catch (TypeError &e) {
+    reportError(context, e.what());
+    return false;
+  }
+
+  // A definition is parsed as `let x = e in ()`, run `e` alone
+  out.defines = phrase.definition;
+  if (out.defines) {
+    auto &let = std::get<TermNode::Let>(prog->payload);
+    out.name = let.name;
+    out.type = let.type;
+    prog = let.e1;
+  }
+  out.prog = resolve(reduce(std::move(prog), context), *visible, outer);
+  out.outer = outer;
+  return true;
+}
+
+const Session::Compiled *Session::prepare(const std::string &text,
+                                          const Definitions &scope,
+                                          uint64_t &key) {
+  const Parsed *phrase = parse(text, false);
+  if (!phrase)
+    return nullptr;
+
+  // Bind only the definitions the phrase refers to around it. Its key
+  // changes with theirs, so phrases depending on an edited one are
+  // compiled again
+  std::vector<Symbol> outer;
+  key = hashSource(text);
+  for (Symbol name : phrase->free) {
+    auto def = scope.find(name);
+    if (def == scope.end())
+      continue;
+    outer.push_back(name);
+    key = mixKey(key, def->second.key);
+  }
+
+  auto cached = cache.find(key);
+  if (cached != cache.end()) {
+    counters.reused++;
+  } else {
+    if (!phrase->term && !(phrase = parse(text, true)))
+      return nullptr;
+    Compiled compiled;
+    if (!compile(*phrase, outer, scope, compiled))
+      return nullptr;
+    cached = cache.emplace(key, std::move(compiled)).first;
+    counters.compiled++;
+  }
+  cached->second.used = loads;
+  return &cached->second;
+}
+
+bool Session::compileNext() {
+  using clock = std::chrono::steady_clock;
+  auto t0 = clock::now();
+  runningText = std::move(pending.front());
+  pending.pop_front();
+
+  ContextScope scope(context);
+  runningPhrase = prepare(runningText, definitions, runningKey);
+  if (!runningPhrase)
+    return false;
+  std::vector<Input> inputs;
+  for (Symbol name : runningPhrase->outer)
+    inputs.push_back({name, definitions.at(name).value});
+  counters.compileMicros +=
+      std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - t0)
+          .count();
+
+  running = std::make_unique<Execution>(runningPhrase->prog, context, engine,
+                                        gc, std::move(inputs));
+  running->output().policy = output;
+  return true;
+}
+
+/*
+    Images
+    ------
+    The body of a session's image is its phrases in order, each as
+
+        definition:u8  free names  key:u64  outer names  name type prog
+
+    names as a count and symbols. The keys are those the phrases get when
+    the file is loaded into a fresh session, which are what compileNext()
+    looks them up by
+*/
+bool Session::saveImage(const std::string &source, const std::string &path) {
+  ContextScope scope(context);
+  std::vector<std::string> phrases = splitPhrases(source);
+  ImageWriter image;
+  image.varint(phrases.size());
+  auto names = [&](const std::vector<Symbol> &list) {
+    image.varint(list.size());
+    for (Symbol name : list)
+      image.symbol(name);
+  };
+
+  // The definitions' types and keys are all compiling needs
+  Definitions declared;
+  for (auto &text : phrases) {
+    uint64_t key;
+    const Compiled *phrase = prepare(text, declared, key);
+    if (!phrase)
+      return false;
+    image.byte(phrase->defines);
+    names(parsed.at(text).free);
+    image.u64(key);
+    names(phrase->outer);
+    image.symbol(phrase->name);
+    image.type(phrase->type);
+    image.term(phrase->prog);
+    if (phrase->defines && !phrase->name.isWildcard())
+      declared[phrase->name] = {phrase->type, Val(), key};
+  }
+
+  std::ofstream out(path, std::ios::binary);
+  out << image.finish(hashSource(source));
+  return bool(out);
+}
+
+bool Session::loadImage(const std::string &source, const std::string &path) {
+  MappedFile file(path);
+  ImageReader image(file.data(), file.size());
+  if (!file.data() || image.source() != hashSource(source))
+    return false;
+
+  ContextScope scope(context);
+  std::vector<std::string> phrases = splitPhrases(source);
+  std::vector<std::pair<Parsed, Compiled>> read;
+  std::vector<uint64_t> keys;
+  try {
+    image.readTables();
+    if (image.varint() != phrases.size())
+      return false;
+    auto names = [&](std::vector<Symbol> &list) {
+      for (uint64_t n = image.varint(); n > 0; n--)
+        list.push_back(image.symbol());
+    };
+    for (size_t i = 0; i < phrases.size(); i++) {
+      Parsed p{nullptr, bool(image.byte()), {}, loads};
+      names(p.free);
+      keys.push_back(image.u64());
+      Compiled c{nullptr, {}, p.definition, Symbol(), nullptr, loads};
+      names(c.outer);
+      c.name = image.symbol();
+      c.type = image.type();
+      c.prog = image.term();
+      read.emplace_back(std::move(p), std::move(c));
+    }
+  } catch (std::runtime_error &) {
+    return false;
+  }
+
+  // Phrases parsed or compiled already are kept as they are
+  for (size_t i = 0; i < phrases.size(); i++) {
+    parsed.emplace(phrases[i], std::move(read[i].first));
+    cache.emplace(keys[i], std::move(read[i].second));
+  }
+  return true;
+}
+
+using Programs = std::vector<std::shared_ptr<const BytecodeProgram>>;
+
+// The programs of `from` whose functions `value` holds, through tuples
+// and the values closures captured
+static Programs programsOf(Val value, const Programs &from) {
+  Programs found;
+  std::vector<Val> stack{value};
+  std::unordered_set<const Value *> seen;
+  while (!stack.empty()) {
+    Val v = stack.back();
+    stack.pop_back();
+    if (!v.isHeap() || !seen.insert(v.heap()).second)
+      continue;
+    if (auto *tuple = std::get_if<Value::Tuple>(&v->payload)) {
+      stack.push_back(tuple->left);
+      stack.push_back(tuple->right);
+    } else if (auto *code = std::get_if<Value::Code>(&v->payload)) {
+      stack.insert(stack.end(), code->captured.begin(), code->captured.end());
+      for (auto &program : from) {
+        auto &fns = program->functions;
+        if (code->fn >= fns.data() && code->fn < fns.data() + fns.size()) {
+          if (std::find(found.begin(), found.end(), program) == found.end())
+            found.push_back(program);
+          break;
+        }
+      }
+    }
+  }
+  return found;
+}
+
+ReturnCode Session::run(Fuel fuel) {
+  while (true) {
+    if (!running) {
+      if (pending.empty())
+        return Ok;
+      if (!compileNext()) {
+        cancel();
+        return Error;
+      }
+    }
+
+    ReturnCode code = running->run(fuel);
+    if (code == OutOfFuel)
+      return OutOfFuel;
+    const Compiled &phrase = *runningPhrase;
+    Val value = running->result();
+    if (code == Ok && phrase.defines && !value) {
+      reportError(context, "session: " + phrase.name.str() +
+                               " is not bound to a value");
+      code = Error;
+    }
+    if (code == Error) {
+      cancel();
+      return Error;
+    }
+
+    // Nothing collects before the value is rooted
+    if (phrase.defines && !phrase.name.isWildcard()) {
+      Definition def{phrase.type, value, runningKey};
+      if (running->bytecode()) {
+        Programs from{running->bytecode()};
+        for (Symbol name : phrase.outer)
+          for (auto &program : definitions.at(name).programs)
+            from.push_back(program);
+        def.programs = programsOf(value, from);
+      }
+      definitions[phrase.name] = std::move(def);
+    }
+    history.push_back(std::move(runningText));
+    running.reset();
+    if (observer)
+      observer(phrase.defines ? phrase.name : Symbol(), value);
+
+    if ((fuel.steps || fuel.micros) && !pending.empty())
+      return OutOfFuel;
+  }
+}
+
+std::vector<std::string> splitPhrases(const std::string &source,
+                                      std::string *rest) {
+  std::vector<std::string> phrases;
+  auto add = [&](size_t begin, size_t end) {
+    size_t first = source.find_first_not_of(" \t\r\n", begin);
+    if (first >= end)
+      return;
+    size_t last = source.find_last_not_of(" \t\r\n", end - 1);
+    phrases.push_back(source.substr(first, last - first + 1));
+  };
+
+  // Comments nest, as the lexer has them
+  size_t begin = 0, comments = 0;
+  bool string = false;
+  for (size_t i = 0; i < source.size(); i++) {
+    char c = source[i], next = i + 1 < source.size() ? source[i + 1] : 0;
+    if (string) {
+      if (c == '\\')
+        i++;
+      else if (c == '"')
+        string = false;
+    } else if (c == '(' && next == '*') {
+      comments++;
+      i++;
+    } else if (comments) {
+      if (c == '*' && next == ')') {
+        comments--;
+        i++;
+      }
+    } else if (c == '"') {
+      string = true;
+    } else if (c == ';' && next == ';') {
+      add(begin, i);
+      begin = ++i + 1;
+    }
+  }
+
+  if (rest)
+    *rest = source.substr(begin);
+  else
+    add(begin, source.size());
+  return phrases;
+}
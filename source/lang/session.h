@@ -0,0 +1,150 @@
+#ifndef SESSION
+#define SESSION
+
+#include "interpreter.h"
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+    Sessions
+    --------
+    A toplevel: phrases, definitions `let x = e` and expressions, are
+    compiled and run one at a time, each in the scope of the definitions
+    before it. A definition lives on as its type and its runtime value in
+    the session's heap, so a phrase is compiled and run on its own, handed
+    only the definitions it refers to: adding one costs the same however
+    long the session has run.
+
+    The engines see a phrase as a program whose free variables are bound
+    outside it (see Execution). Definitions of the bytecode engine keep the
+    programs their functions point into, their own or those of the
+    definitions they were given, until they are redefined.
+
+    Compiled phrases are cached, keyed by a hash of their text and the keys
+    of the definitions they refer to. When load() starts over after an
+    edit, only the phrases that changed and those depending on them are
+    typechecked and reduced again, the others are run as they were compiled.
+    saveImage() writes the compiled phrases of a file to an image (see
+    image.h) and loadImage() fills the cache from it, so a file opened again
+    runs without being parsed or compiled until it is edited
+*/
+class Session : public GcRoots {
+public:
+  explicit Session(Engine engine = CEK, std::ostream &diagnostics = std::cerr);
+  ~Session();
+  Session(const Session &) = delete;
+  Session &operator=(const Session &) = delete;
+
+  // Queue one phrase
+  void submit(std::string phrase);
+  // Queue the phrases of `source` the session has not run yet, e.g. an
+  // edited file. If one it ran differs now, the session starts over
+  void load(const std::string &source);
+
+  // Compile and run the queued phrases in order. Returns OutOfFuel with the
+  // running phrase kept when a limit is hit, a limited run finishes at most
+  // one phrase. Error drops the phrases queued after the one that failed,
+  // the definitions before it stay
+  ReturnCode run(Fuel fuel = {});
+  bool idle() const { return !running && pending.empty(); }
+  // Drop the running and queued phrases, the definitions stay
+  void cancel();
+
+  // Compile the phrases of `source` without running them and write them to
+  // an image at `path`. False if one does not compile or it cannot be
+  // written
+  bool saveImage(const std::string &source, const std::string &path);
+  // Cache the phrases of the image at `path`, if it was made from `source`
+  // by this version. False if there is none or it is stale
+  bool loadImage(const std::string &source, const std::string &path);
+
+  // Called with the value of each phrase that ran and the name it was
+  // bound to, the wildcard for expressions
+  using ResultObserver = std::function<void(Symbol name, const Val &value)>;
+  void onResult(ResultObserver observer) { this->observer = observer; }
+
+  struct Stats {
+    size_t compiled = 0, reused = 0; // phrases compiled, found in the cache
+    uint64_t compileMicros = 0;      // parsing and compiling them
+  };
+  const Stats &stats() const { return counters; }
+
+  // Flush policy of the phrases' output channels
+  OutChannel::FlushPolicy output = OutChannel::OnSize;
+  Heap &heap() { return gc; }
+  // The definitions' values and the constants of their bytecode
+  void trace(Heap &heap) const override;
+
+private:
+  struct Definition {
+    Type type;
+    Val value;
+    uint64_t key; // of the phrase that made it
+    // Bytecode the value's functions point into, released with it
+    std::vector<std::shared_ptr<const BytecodeProgram>> programs;
+  };
+  using Definitions = std::unordered_map<Symbol, Definition>;
+
+  // A phrase as parsed, before primitives are told from definitions
+  struct Parsed {
+    Term term; // null when read from an image, parsed if it is compiled
+    bool definition;
+    std::vector<Symbol> free; // names it refers to, first occurrence first
+    size_t used;
+  };
+
+  // A phrase compiled against the definitions in `outer`
+  struct Compiled {
+    Term prog;
+    std::vector<Symbol> outer;
+    bool defines;
+    Symbol name;
+    Type type;
+    size_t used; // the load() it was last used in
+  };
+
+  // Parse `text`, or only find its free names when `term` is false. Null
+  // if it does not parse
+  const Parsed *parse(const std::string &text, bool term);
+  // `text` compiled against `scope`, from the cache or compiled now, and
+  // its key. Null if it does not compile
+  const Compiled *prepare(const std::string &text, const Definitions &scope,
+                          uint64_t &key);
+  // Compile `parsed` against the definitions of `scope` `outer` names
+  bool compile(const Parsed &parsed, const std::vector<Symbol> &outer,
+               const Definitions &scope, Compiled &out);
+  // Compile the next queued phrase into `running`, false if it failed
+  bool compileNext();
+  void reset();
+
+  Engine engine;
+  Context context; // of every phrase
+  Heap gc;
+  Definitions definitions; // latest of each name
+  std::vector<std::string> history; // phrases that ran, in order
+  std::deque<std::string> pending;
+
+  // Entries not used by the last two loads are dropped
+  std::unordered_map<std::string, Parsed> parsed;
+  std::unordered_map<uint64_t, Compiled> cache;
+  size_t loads = 0;
+  Stats counters;
+
+  std::unique_ptr<Execution> running;
+  std::string runningText;
+  uint64_t runningKey = 0;
+  const Compiled *runningPhrase = nullptr;
+  ResultObserver observer;
+};
+
+// The phrases of `source`: the text between `;;` outside comments and
+// string literals, blank ones dropped. The text after the last `;;` is one
+// too, unless `rest` is given to hold it
+std::vector<std::string> splitPhrases(const std::string &source,
+                                      std::string *rest = nullptr);
+
+#endif /* SESSION */
@@ -1,14 +1,50 @@
 #include "stdlib.h"
+#include <charconv>
+#include <cstdio>
 #include <iostream>
+#include <unordered_set>
 
 bool isPrimitive(Term term) {
-  return term->kind == TermNode::TmVar &&
-         primitives.count(std::get<TermNode::Var>(term->payload).name) > 0;
+  return term->kind == TermNode::TmPrim;
+}
+
+// Used when no program is running
+static OutChannel defaultOut = {OutChannel::OnNewline};
+thread_local OutChannel *currentOut = &defaultOut;
+thread_local std::istream *currentIn = &std::cin;
+
+void OutChannel::write(std::string_view s) {
+  buffer.append(s);
+  if ((policy == OnNewline && s.find('\n') != std::string_view::npos) ||
+      (policy == OnSize && buffer.size() >= threshold))
+    flush();
+}
+
+void OutChannel::flush() {
+  if (buffer.empty())
+    return;
+  if (capture) {
+    capture->append(buffer);
+  } else {
+    std::cout.write(buffer.data(), buffer.size());
+    std::cout.flush();
+  }
+  buffer.clear();
+}
+
+// Payload of an immediate or string argument
+template <typename T> static T valueAs(const Val &v);
+template <> int valueAs<int>(const Val &v) { return v.asInt(); }
+template <> double valueAs<double>(const Val &v) { return v.asFloat(); }
+template <> bool valueAs<bool>(const Val &v) { return v.asBool(); }
+template <> std::monostate valueAs<std::monostate>(const Val &) { return {}; }
+template <> Rope valueAs<Rope>(const Val &v) {
+  return std::get<Rope>(v->payload);
 }
 
 #define _UNARY(name, type, ret, in, out)                                       \
-  Primitive name = {.f = [](Term arg) -> Term {                                \
-                      type val = std::get<type>(arg->payload);                 \
+  Primitive name = {.f = [](const Val &arg) -> Val {                           \
+                      type val = valueAs<type>(arg);                           \
                       ret;                                                     \
                     },                                                         \
                     .t = TypeNode::ArrowType(TypeNode::in, TypeNode::out)};
@@ -16,57 +52,64 @@ bool isPrimitive(Term term) {
 #define UNARY(name, type, ret, in, out) _UNARY(name, type, ret, in(), out())
 
 #define BINARY(name, type1, type2, ret, in1, in2, out)                         \
-  Primitive name = {.f = [](Term arg) -> Term {                                \
-                      TermNode::Tuple tup =                                    \
-                          std::get<TermNode::Tuple>(arg->payload);             \
-                      type1 val1 = std::get<type1>(tup.left->payload);         \
-                      type2 val2 = std::get<type2>(tup.right->payload);        \
-                      ret;                                                     \
+  static Val name##_2(const Val &arg1, const Val &arg2) {                      \
+    type1 val1 = valueAs<type1>(arg1);                                         \
+    type2 val2 = valueAs<type2>(arg2);                                         \
+    ret;                                                                       \
+  }                                                                            \
+  Primitive name = {.f = [](const Val &arg) -> Val {                           \
+                      auto &tup = std::get<Value::Tuple>(arg->payload);        \
+                      return name##_2(tup.left, tup.right);                    \
                     },                                                         \
                     .t = TypeNode::ArrowType(                                  \
                         TypeNode::TupleType(TypeNode::in1(), TypeNode::in2()), \
-                        TypeNode::out())};
+                        TypeNode::out()),                                      \
+                    .f2 = name##_2};
 
 // ------------------ Output functions ------------------
 
 UNARY(
-    print_string, std::string,
+    print_string, Rope,
     {
-      std::cout << val;
-      return TermNode::Unit();
+      currentOut->write(val.view());
+      return Val::Unit();
     },
     String, Unit)
 
 UNARY(
-    print_endline, std::string,
+    print_endline, Rope,
     {
-      std::cout << val << std::endl;
-      return TermNode::Unit();
+      currentOut->write(val.view());
+      currentOut->write("\n");
+      return Val::Unit();
     },
     String, Unit)
 
 UNARY(
     print_int, int,
     {
-      std::cout << val;
-      return TermNode::Unit();
+      char buf[16];
+      auto res = std::to_chars(buf, buf + sizeof buf, val);
+      currentOut->write(std::string_view(buf, res.ptr - buf));
+      return Val::Unit();
     },
     Int, Unit)
 
 UNARY(
     print_float, double,
     {
-      std::streamsize ss = std::cout.precision();
-      std::cout << std::setprecision(15) << val << std::setprecision(ss);
-      return TermNode::Unit();
+      char buf[32];
+      int n = snprintf(buf, sizeof buf, "%.15g", val);
+      currentOut->write(std::string_view(buf, n));
+      return Val::Unit();
     },
     Float, Unit)
 
 UNARY(
     print_bool, bool,
     {
-      std::cout << std::boolalpha << val << std::noboolalpha;
-      return TermNode::Unit();
+      currentOut->write(val ? "true" : "false");
+      return Val::Unit();
     },
     Bool, Unit)
 
@@ -78,6 +121,8 @@ UNARY(
 UNARY(
     read_line, std::monostate,
     {
+      // Show any pending prompt before blocking on input
+      currentOut->flush();
 
 #ifdef __3DS__
       char buf[READ_MAX];
@@ -85,11 +130,11 @@ UNARY(
       setupKeyboard("read_line", "");
       swkbdInputText(&swkbd, buf, READ_MAX);
       //   std::cout << buf << std::endl;
-      return TermNode::String(buf);
+      return Value::StringValue(buf);
 #else
       std::string in;
-      std::getline(std::cin, in);
-      return TermNode::String(in);
+      std::getline(*currentIn, in);
+      return Value::StringValue(in);
 #endif
     },
     Unit, String)
@@ -97,6 +142,8 @@ UNARY(
 UNARY(
     read_int, std::monostate,
     {
+      // Show any pending prompt before blocking on input
+      currentOut->flush();
 
 #ifdef __3DS__
       char buf[READ_MAX];
@@ -106,11 +153,11 @@ UNARY(
       int x = std::stoi(buf);
       //   std::cout << x << std::endl;
       normalKeyboardInit();
-      return TermNode::Int(x);
+      return Val::Int(x);
 #else
       std::string in;
-      std::getline(std::cin, in);
-      return TermNode::Int(std::stoi(in));
+      std::getline(*currentIn, in);
+      return Val::Int(std::stoi(in));
 #endif
     },
     Unit, Int)
@@ -118,6 +165,8 @@ UNARY(
 UNARY(
     read_float, std::monostate,
     {
+      // Show any pending prompt before blocking on input
+      currentOut->flush();
 
 #ifdef __3DS__
       char buf[READ_MAX];
@@ -127,158 +176,158 @@ UNARY(
       double x = std::stod(buf);
       //   std::cout << x << std::endl;
       normalKeyboardInit();
-      return TermNode::Float(x);
+      return Val::Float(x);
 #else
       std::string in;
-      std::getline(std::cin, in);
-      return TermNode::Float(std::stod(in));
+      std::getline(*currentIn, in);
+      return Val::Float(std::stod(in));
 #endif
     },
     Unit, Float)
 
 // ------------------ Boolean functions ------------------
 
-UNARY(_not, bool, { return TermNode::Bool(!val); }, Bool, Bool)
+UNARY(_not, bool, { return Val::Bool(!val); }, Bool, Bool)
 
 BINARY(
-    _and, bool, bool, { return TermNode::Bool(val1 && val2); }, Bool, Bool,
+    _and, bool, bool, { return Val::Bool(val1 && val2); }, Bool, Bool,
     Bool)
 
 BINARY(
-    _or, bool, bool, { return TermNode::Bool(val1 || val2); }, Bool, Bool, Bool)
+    _or, bool, bool, { return Val::Bool(val1 || val2); }, Bool, Bool, Bool)
 
 // ------------------ Integer functions ------------------
 
-UNARY(neg, int, { return TermNode::Int(-val); }, Int, Int)
+UNARY(neg, int, { return Val::Int(-val); }, Int, Int)
 
-UNARY(succ, int, { return TermNode::Int(val + 1); }, Int, Int)
+UNARY(succ, int, { return Val::Int(val + 1); }, Int, Int)
 
-UNARY(pred, int, { return TermNode::Int(val - 1); }, Int, Int)
+UNARY(pred, int, { return Val::Int(val - 1); }, Int, Int)
 
-BINARY(add, int, int, { return TermNode::Int(val1 + val2); }, Int, Int, Int)
+BINARY(add, int, int, { return Val::Int(val1 + val2); }, Int, Int, Int)
 
-BINARY(sub, int, int, { return TermNode::Int(val1 - val2); }, Int, Int, Int)
+BINARY(sub, int, int, { return Val::Int(val1 - val2); }, Int, Int, Int)
 
-BINARY(mul, int, int, { return TermNode::Int(val1 * val2); }, Int, Int, Int)
+BINARY(mul, int, int, { return Val::Int(val1 * val2); }, Int, Int, Int)
 
-BINARY(_div, int, int, { return TermNode::Int(val1 / val2); }, Int, Int, Int)
+BINARY(_div, int, int, { return Val::Int(val1 / val2); }, Int, Int, Int)
 
-BINARY(mod, int, int, { return TermNode::Int(val1 % val2); }, Int, Int, Int)
+BINARY(mod, int, int, { return Val::Int(val1 % val2); }, Int, Int, Int)
 
-UNARY(_abs, int, { return TermNode::Int(abs(val)); }, Int, Int)
+UNARY(_abs, int, { return Val::Int(abs(val)); }, Int, Int)
 
-BINARY(land, int, int, { return TermNode::Int(val1 & val2); }, Int, Int, Int)
+BINARY(land, int, int, { return Val::Int(val1 & val2); }, Int, Int, Int)
 
-BINARY(lor, int, int, { return TermNode::Int(val1 | val2); }, Int, Int, Int)
+BINARY(lor, int, int, { return Val::Int(val1 | val2); }, Int, Int, Int)
 
-BINARY(lxor, int, int, { return TermNode::Int(val1 ^ val2); }, Int, Int, Int)
+BINARY(lxor, int, int, { return Val::Int(val1 ^ val2); }, Int, Int, Int)
 
-UNARY(lnot, int, { return TermNode::Int(~val); }, Int, Int)
+UNARY(lnot, int, { return Val::Int(~val); }, Int, Int)
 
-BINARY(lsl, int, int, { return TermNode::Int(val1 << val2); }, Int, Int, Int)
+BINARY(lsl, int, int, { return Val::Int(val1 << val2); }, Int, Int, Int)
 
 BINARY(
     lsr, int, int,
-    { return TermNode::Int(static_cast<unsigned int>(val1) >> val2); }, Int,
+    { return Val::Int(static_cast<unsigned int>(val1) >> val2); }, Int,
     Int, Int)
 
-BINARY(asr, int, int, { return TermNode::Int(val1 >> val2); }, Int, Int, Int)
+BINARY(asr, int, int, { return Val::Int(val1 >> val2); }, Int, Int, Int)
 
 // ------------------ Float functions ------------------
 
-UNARY(fneg, double, { return TermNode::Float(-val); }, Float, Float)
+UNARY(fneg, double, { return Val::Float(-val); }, Float, Float)
 
-UNARY(fpos, double, { return TermNode::Float(+val); }, Float, Float)
+UNARY(fpos, double, { return Val::Float(+val); }, Float, Float)
 
 BINARY(
-    _fadd, double, double, { return TermNode::Float(val1 + val2); }, Float,
+    _fadd, double, double, { return Val::Float(val1 + val2); }, Float,
     Float, Float)
 
 BINARY(
-    _fsub, double, double, { return TermNode::Float(val1 - val2); }, Float,
+    _fsub, double, double, { return Val::Float(val1 - val2); }, Float,
     Float, Float)
 
 BINARY(
-    _fmul, double, double, { return TermNode::Float(val1 * val2); }, Float,
+    _fmul, double, double, { return Val::Float(val1 * val2); }, Float,
     Float, Float)
 
 BINARY(
-    _fdiv, double, double, { return TermNode::Float(val1 / val2); }, Float,
+    _fdiv, double, double, { return Val::Float(val1 / val2); }, Float,
     Float, Float)
 
 BINARY(
-    fpow, double, double, { return TermNode::Float(std::pow(val1, val2)); },
+    fpow, double, double, { return Val::Float(std::pow(val1, val2)); },
     Float, Float, Float)
 
-UNARY(_fsqrt, double, { return TermNode::Float(std::sqrt(val)); }, Float, Float)
+UNARY(_fsqrt, double, { return Val::Float(std::sqrt(val)); }, Float, Float)
 
-UNARY(_fexp, double, { return TermNode::Float(std::exp(val)); }, Float, Float)
+UNARY(_fexp, double, { return Val::Float(std::exp(val)); }, Float, Float)
 
-UNARY(flog, double, { return TermNode::Float(std::log(val)); }, Float, Float)
+UNARY(flog, double, { return Val::Float(std::log(val)); }, Float, Float)
 
 UNARY(
-    flog10, double, { return TermNode::Float(std::log10(val)); }, Float, Float)
+    flog10, double, { return Val::Float(std::log10(val)); }, Float, Float)
 
 UNARY(
-    fexpm1, double, { return TermNode::Float(std::expm1(val)); }, Float, Float)
+    fexpm1, double, { return Val::Float(std::expm1(val)); }, Float, Float)
 
 UNARY(
-    flog1p, double, { return TermNode::Float(std::log1p(val)); }, Float, Float)
+    flog1p, double, { return Val::Float(std::log1p(val)); }, Float, Float)
 
-UNARY(fcos, double, { return TermNode::Float(std::cos(val)); }, Float, Float)
+UNARY(fcos, double, { return Val::Float(std::cos(val)); }, Float, Float)
 
-UNARY(fsin, double, { return TermNode::Float(std::sin(val)); }, Float, Float)
+UNARY(fsin, double, { return Val::Float(std::sin(val)); }, Float, Float)
 
-UNARY(ftan, double, { return TermNode::Float(std::tan(val)); }, Float, Float)
+UNARY(ftan, double, { return Val::Float(std::tan(val)); }, Float, Float)
 
-UNARY(facos, double, { return TermNode::Float(std::acos(val)); }, Float, Float)
+UNARY(facos, double, { return Val::Float(std::acos(val)); }, Float, Float)
 
-UNARY(fasin, double, { return TermNode::Float(std::asin(val)); }, Float, Float)
+UNARY(fasin, double, { return Val::Float(std::asin(val)); }, Float, Float)
 
-UNARY(fatan, double, { return TermNode::Float(std::atan(val)); }, Float, Float)
+UNARY(fatan, double, { return Val::Float(std::atan(val)); }, Float, Float)
 
 BINARY(
-    fatan2, double, double, { return TermNode::Float(std::atan2(val1, val2)); },
+    fatan2, double, double, { return Val::Float(std::atan2(val1, val2)); },
     Float, Float, Float)
 
-UNARY(fcosh, double, { return TermNode::Float(std::cosh(val)); }, Float, Float)
+UNARY(fcosh, double, { return Val::Float(std::cosh(val)); }, Float, Float)
 
-UNARY(fsinh, double, { return TermNode::Float(std::sinh(val)); }, Float, Float)
+UNARY(fsinh, double, { return Val::Float(std::sinh(val)); }, Float, Float)
 
-UNARY(ftanh, double, { return TermNode::Float(std::tanh(val)); }, Float, Float)
+UNARY(ftanh, double, { return Val::Float(std::tanh(val)); }, Float, Float)
 
 UNARY(
-    facosh, double, { return TermNode::Float(std::acosh(val)); }, Float, Float)
+    facosh, double, { return Val::Float(std::acosh(val)); }, Float, Float)
 
 UNARY(
-    fasinh, double, { return TermNode::Float(std::asinh(val)); }, Float, Float)
+    fasinh, double, { return Val::Float(std::asinh(val)); }, Float, Float)
 
 UNARY(
-    fatanh, double, { return TermNode::Float(std::atanh(val)); }, Float, Float)
+    fatanh, double, { return Val::Float(std::atanh(val)); }, Float, Float)
 
 BINARY(
-    fhypot, double, double, { return TermNode::Float(std::hypot(val1, val2)); },
+    fhypot, double, double, { return Val::Float(std::hypot(val1, val2)); },
     Float, Float, Float)
 
 BINARY(
     fcopysign, double, double,
-    { return TermNode::Float(std::copysign(val1, val2)); }, Float, Float, Float)
+    { return Val::Float(std::copysign(val1, val2)); }, Float, Float, Float)
 
 BINARY(
     fmod_float, double, double,
-    { return TermNode::Float(std::fmod(val1, val2)); }, Float, Float, Float)
+    { return Val::Float(std::fmod(val1, val2)); }, Float, Float, Float)
 
 _UNARY(
     ffrexp, double,
     {
       int exp;
       double sig = std::frexp(val, &exp);
-      return TermNode::TupleTerm(TermNode::Float(sig), TermNode::Int(exp));
+      return Value::TupleValue(Val::Float(sig), Val::Int(exp));
     },
     Float(), TupleType(TypeNode::Float(), TypeNode::Int()))
 
 BINARY(
-    fldexp, double, int, { return TermNode::Float(std::ldexp(val1, val2)); },
+    fldexp, double, int, { return Val::Float(std::ldexp(val1, val2)); },
     Float, Int, Float)
 
 _UNARY(
@@ -286,24 +335,47 @@ _UNARY(
     {
       double intpart;
       double frac = std::modf(val, &intpart);
-      return TermNode::TupleTerm(TermNode::Float(frac),
-                                 TermNode::Float(intpart));
+      return Value::TupleValue(Val::Float(frac),
+                                 Val::Float(intpart));
     },
     Float(), TupleType(TypeNode::Float(), TypeNode::Float()))
 
 UNARY(
-    float_of_int, int, { return TermNode::Float(static_cast<double>(val)); },
+    float_of_int, int, { return Val::Float(static_cast<double>(val)); },
     Int, Float)
 
 UNARY(
-    int_of_float, double, { return TermNode::Int(static_cast<int>(val)); },
+    int_of_float, double, { return Val::Int(static_cast<int>(val)); },
     Float, Int)
 
 // ------------------ String functions ------------------
 
 BINARY(
-    concat, std::string, std::string, { return TermNode::String(val1 + val2); },
-    String, String, String)
+    concat, Rope, Rope,
+    { return Value::StringValue(Rope::concat(val1, val2)); }, String,
+    String, String)
+
+UNARY(string_length, Rope, { return Val::Int(val.size()); }, String, Int)
+
+// string_sub s pos len, shares the text of `s` rather than copying it. The
+// tupled type is how primitiveArgs() spreads it over three arguments
+Primitive string_sub = {
+    .f = [](const Val &arg) -> Val {
+      auto &args = std::get<Value::Tuple>(arg->payload);
+      auto &range = std::get<Value::Tuple>(args.right->payload);
+      Rope s = valueAs<Rope>(args.left);
+      int pos = range.left.asInt();
+      int len = range.right.asInt();
+      if (pos < 0 || len < 0 || static_cast<size_t>(pos) > s.size() ||
+          static_cast<size_t>(len) > s.size() - pos)
+        throw std::runtime_error("string_sub: out of bounds");
+      return Value::StringValue(s.sub(pos, len));
+    },
+    .t = TypeNode::ArrowType(
+        TypeNode::TupleType(TypeNode::String(),
+                            TypeNode::TupleType(TypeNode::Int(),
+                                                TypeNode::Int())),
+        TypeNode::String())};
 
 const std::vector<std::pair<std::string_view, Primitive>> primitive_list{
     {{"print_string", print_string},
@@ -374,11 +446,24 @@ const std::vector<std::pair<std::string_view, Primitive>> primitive_list{
      {"int_of_float", int_of_float},
      {"truncate", int_of_float},
 
-     {"concat", concat}}};
+     {"concat", concat},
+     {"string_length", string_length},
+     {"string_sub", string_sub}}};
+
+bool performsIO(const Primitive *p) {
+  static const std::unordered_set<const Primitive *> io = [] {
+    std::unordered_set<const Primitive *> s;
+    for (auto &[name, prim] : primitive_list)
+      if (name.substr(0, 6) == "print_" || name.substr(0, 5) == "read_")
+        s.insert(&prim);
+    return s;
+  }();
+  return io.count(p) != 0;
+}
 
-const std::unordered_map<std::string, Primitive> primitives = [] {
-  std::unordered_map<std::string, Primitive> m;
+const PrimitiveTable primitives = [] {
+  PrimitiveTable m;
   for (auto &p : primitive_list)
-    m.emplace(std::string(p.first), p.second);
+    m.emplace(Symbol::intern(p.first), &p.second);
   return m;
 }();
@@ -2,11 +2,15 @@
 #define STDLIB_H
 
 #include "../../globals.h"
+#include "../context.h"
+#include "../runtime/value.h"
 #include "../syntax.h"
 #include <cmath>
 #include <iomanip>
+#include <istream>
 #include <limits>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -14,16 +18,52 @@
 #include "../../ui.h"
 #endif
 
-using PrimitiveFunc = Term (*)(Term arg);
+// Buffered output written by the print primitives
+struct OutChannel {
+  enum FlushPolicy {
+    OnNewline, // after every write containing '\n'
+    OnSize,    // once `threshold` bytes are buffered
+    PerRun,    // when Execution::run returns, once per frame on the 3DS
+    AtEnd      // only when the program ends
+  } policy = OnSize;
+  size_t threshold = 4096;
+  std::string buffer;
+  // Where flushed output goes instead of stdout, if set
+  std::string *capture = nullptr;
+
+  void write(std::string_view s);
+  void flush();
+};
+
+// Channel the print primitives write to, Execution::run points it at the
+// running program's State::outChannel. Per thread, so programs can run side
+// by side
+extern thread_local OutChannel *currentOut;
+
+// Stream the read primitives take lines from on the host, std::cin unless
+// pointed elsewhere
+extern thread_local std::istream *currentIn;
+
+using PrimitiveFunc = Val (*)(const Val &arg);
+// Binary primitives also take their operands unpacked, so callers that
+// already hold both sides need not build the tuple
+using PrimitiveFunc2 = Val (*)(const Val &left, const Val &right);
 
 typedef struct Primitive {
   PrimitiveFunc f;
   Type t;
+  PrimitiveFunc2 f2 = nullptr;
 } Primitive;
 
 extern const std::vector<std::pair<std::string_view, Primitive>> primitive_list;
-extern const std::unordered_map<std::string, Primitive> primitives;
+// Primitives by name, pointing into primitive_list, the table contexts use
+// unless given another. Only consulted while compiling, resolve() turns
+// references into TmPrim nodes
+extern const PrimitiveTable primitives;
 
+// Whether `tm` is a primitive reference (TmPrim)
 bool isPrimitive(Term tm);
+// Whether calling `p` reads input or writes output
+bool performsIO(const Primitive *p);
 
 #endif
@@ -0,0 +1,40 @@
+#include "symbol.h"
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+namespace {
+
+// Names by ID. A deque never moves its elements, so the index can key on
+// views of them
+struct SymbolTable {
+  std::deque<std::string> names{"_"};
+  std::unordered_map<std::string_view, uint32_t> ids{{names.front(), 0}};
+  std::mutex lock;
+};
+
+// Leaked, symbols live as long as the program
+SymbolTable &table() {
+  static auto *t = new SymbolTable;
+  return *t;
+}
+
+} // namespace
+
+Symbol Symbol::intern(std::string_view name) {
+  auto &t = table();
+  std::lock_guard<std::mutex> guard(t.lock);
+  auto it = t.ids.find(name);
+  if (it != t.ids.end())
+    return Symbol(it->second);
+  uint32_t id = t.names.size();
+  t.ids.emplace(t.names.emplace_back(name), id);
+  return Symbol(id);
+}
+
+// The name stays put, only finding it races with interning
+const std::string &Symbol::str() const {
+  auto &t = table();
+  std::lock_guard<std::mutex> guard(t.lock);
+  return t.names[id];
+}
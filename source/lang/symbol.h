@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+/*
+    Symbols
+    -------
+    Identifiers are interned once, by the lexer, into a global table and
+    passed around as 32-bit IDs. Comparing or hashing a symbol is an integer
+    operation and terms do not carry a copy of the name. ID 0 is `_`, the
+    wildcard that never binds, so testing for it needs no lookup. The table
+    is shared by every context and locks, symbols are only looked up while
+    lexing and when spelling them
+*/
+class Symbol {
+public:
+  // The wildcard `_`
+  constexpr Symbol() : id(0) {}
+
+  // The symbol spelled `name`, added to the table on first use
+  static Symbol intern(std::string_view name);
+
+  bool isWildcard() const { return id == 0; }
+  uint32_t index() const { return id; }
+  const std::string &str() const;
+
+  bool operator==(Symbol other) const { return id == other.id; }
+  bool operator!=(Symbol other) const { return id != other.id; }
+
+private:
+  explicit Symbol(uint32_t id) : id(id) {}
+
+  uint32_t id;
+};
+
+inline std::ostream &operator<<(std::ostream &out, Symbol s) {
+  return out << s.str();
+}
+
+namespace std {
+template <> struct hash<Symbol> {
+  size_t operator()(Symbol s) const { return s.index(); }
+};
+} // namespace std
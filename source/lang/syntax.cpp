@@ -1,4 +1,9 @@
 #include "syntax.h"
+#include "context.h"
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
 
 // precedence: 0 = top, 1 = arrow, 2 = tuple (higher number => tighter binding)
 static std::string stringOfTypeWithPrec(Type t, int prec) {
@@ -102,6 +107,10 @@ std::string stringOfTerm(Term t, int depth) {
     break;
   }
 
+  case TermNode::TmPrim:
+    out << std::get<TermNode::Prim>(t->payload).name;
+    break;
+
   case TermNode::TmTuple: {
     auto const &tp = std::get<TermNode::Tuple>(t->payload);
     out << wrap(stringOfTerm(tp.left) + ", " + stringOfTerm(tp.right));
@@ -110,7 +119,8 @@ std::string stringOfTerm(Term t, int depth) {
 
   case TermNode::TmLet: {
     auto const &lt = std::get<TermNode::Let>(t->payload);
-    out << "let " + wrap(lt.name + " : " + stringOfType(lt.type)) << " =\n"
+    out << "let " + wrap(lt.name.str() + " : " + stringOfType(lt.type))
+        << " =\n"
         << std::string(depth + 1, ' ') << wrap(stringOfTerm(lt.e1, 0))
         << " in\n"
         << wrap(stringOfTerm(lt.e2, depth));
@@ -119,7 +129,8 @@ std::string stringOfTerm(Term t, int depth) {
 
   case TermNode::TmAbs: {
     auto const &fn = std::get<TermNode::Abs>(t->payload);
-    out << wrap("fun " + wrap(fn.param + " : " + stringOfType(fn.paramType)) +
+    out << wrap("fun " +
+                wrap(fn.param.str() + " : " + stringOfType(fn.paramType)) +
                 " -> " + stringOfTerm(fn.body, 0));
     break;
   }
@@ -132,3 +143,447 @@ std::string stringOfTerm(Term t, int depth) {
   }
   return out.str();
 }
+
+/*
+    Hash-consing
+    ------------
+    Nodes are looked up by their shallow contents: kind, scalar payload and
+    the addresses of their children, which are interned already. The table
+    only holds weak references, a node removes itself when it dies
+*/
+namespace {
+
+inline size_t mix(size_t seed, uint64_t v) {
+  v *= 0xff51afd7ed558ccdull;
+  v ^= v >> 32;
+  return seed ^ (v + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+}
+
+template <typename T> inline size_t hashOf(const T &v) {
+  return std::hash<T>()(v);
+}
+
+// Floats are keyed by their bits, so 0.0 and -0.0 stay apart
+inline uint64_t bitsOf(double d) {
+  uint64_t b;
+  std::memcpy(&b, &d, sizeof b);
+  return b;
+}
+
+size_t shallowHash(const TypeNode &n) {
+  size_t h = n.kind;
+  switch (n.kind) {
+  case TypeNode::TTuple: {
+    auto &tp = std::get<TypeNode::Tuple>(n.payload);
+    return mix(mix(h, hashOf(tp.left.get())), hashOf(tp.right.get()));
+  }
+  case TypeNode::TArrow: {
+    auto &ar = std::get<TypeNode::Arrow>(n.payload);
+    return mix(mix(h, hashOf(ar.param.get())), hashOf(ar.result.get()));
+  }
+  default:
+    return h;
+  }
+}
+
+bool shallowEqual(const TypeNode &a, const TypeNode &b) {
+  if (a.kind != b.kind)
+    return false;
+  switch (a.kind) {
+  case TypeNode::TTuple: {
+    auto &A = std::get<TypeNode::Tuple>(a.payload);
+    auto &B = std::get<TypeNode::Tuple>(b.payload);
+    return A.left == B.left && A.right == B.right;
+  }
+  case TypeNode::TArrow: {
+    auto &A = std::get<TypeNode::Arrow>(a.payload);
+    auto &B = std::get<TypeNode::Arrow>(b.payload);
+    return A.param == B.param && A.result == B.result;
+  }
+  default:
+    return true;
+  }
+}
+
+size_t shallowHash(const TermNode &n) {
+  size_t h = mix(n.kind, hashOf(n.type.get()));
+  switch (n.kind) {
+  case TermNode::TmUnit:
+    return h;
+  case TermNode::TmBool:
+    return mix(h, std::get<bool>(n.payload));
+  case TermNode::TmInt:
+    return mix(h, hashOf(std::get<int>(n.payload)));
+  case TermNode::TmFloat:
+    return mix(h, hashOf(bitsOf(std::get<double>(n.payload))));
+  case TermNode::TmString:
+    return mix(h, hashOf(std::get<std::string>(n.payload)));
+  case TermNode::TmVar: {
+    auto &v = std::get<TermNode::Var>(n.payload);
+    return mix(mix(h, hashOf(v.name)), hashOf(v.index));
+  }
+  case TermNode::TmPrim:
+    return mix(h, hashOf(std::get<TermNode::Prim>(n.payload).prim));
+  case TermNode::TmTuple: {
+    auto &tp = std::get<TermNode::Tuple>(n.payload);
+    return mix(mix(h, hashOf(tp.left.get())), hashOf(tp.right.get()));
+  }
+  case TermNode::TmLet: {
+    auto &lt = std::get<TermNode::Let>(n.payload);
+    h = mix(mix(h, hashOf(lt.name)), hashOf(lt.type.get()));
+    return mix(mix(h, hashOf(lt.e1.get())), hashOf(lt.e2.get()));
+  }
+  case TermNode::TmAbs: {
+    auto &fn = std::get<TermNode::Abs>(n.payload);
+    h = mix(mix(h, hashOf(fn.param)), hashOf(fn.paramType.get()));
+    return mix(h, hashOf(fn.body.get()));
+  }
+  case TermNode::TmApp: {
+    auto &ap = std::get<TermNode::App>(n.payload);
+    return mix(mix(h, hashOf(ap.f.get())), hashOf(ap.arg.get()));
+  }
+  }
+  return h;
+}
+
+bool shallowEqual(const TermNode &a, const TermNode &b) {
+  if (a.kind != b.kind || a.type != b.type)
+    return false;
+  switch (a.kind) {
+  case TermNode::TmUnit:
+    return true;
+  case TermNode::TmBool:
+    return std::get<bool>(a.payload) == std::get<bool>(b.payload);
+  case TermNode::TmInt:
+    return std::get<int>(a.payload) == std::get<int>(b.payload);
+  case TermNode::TmFloat:
+    return bitsOf(std::get<double>(a.payload)) ==
+           bitsOf(std::get<double>(b.payload));
+  case TermNode::TmString:
+    return std::get<std::string>(a.payload) ==
+           std::get<std::string>(b.payload);
+  case TermNode::TmVar: {
+    auto &A = std::get<TermNode::Var>(a.payload);
+    auto &B = std::get<TermNode::Var>(b.payload);
+    return A.name == B.name && A.index == B.index;
+  }
+  case TermNode::TmPrim:
+    return std::get<TermNode::Prim>(a.payload).prim ==
+           std::get<TermNode::Prim>(b.payload).prim;
+  case TermNode::TmTuple: {
+    auto &A = std::get<TermNode::Tuple>(a.payload);
+    auto &B = std::get<TermNode::Tuple>(b.payload);
+    return A.left == B.left && A.right == B.right;
+  }
+  case TermNode::TmLet: {
+    auto &A = std::get<TermNode::Let>(a.payload);
+    auto &B = std::get<TermNode::Let>(b.payload);
+    return A.name == B.name && A.type == B.type && A.e1 == B.e1 &&
+           A.e2 == B.e2;
+  }
+  case TermNode::TmAbs: {
+    auto &A = std::get<TermNode::Abs>(a.payload);
+    auto &B = std::get<TermNode::Abs>(b.payload);
+    return A.param == B.param && A.paramType == B.paramType &&
+           A.body == B.body;
+  }
+  case TermNode::TmApp: {
+    auto &A = std::get<TermNode::App>(a.payload);
+    auto &B = std::get<TermNode::App>(b.payload);
+    return A.f == B.f && A.arg == B.arg;
+  }
+  }
+  return false;
+}
+
+// Open-addressing table with linear probing over node addresses. Dead nodes
+// leave a tombstone until the next rehash
+template <typename Node> class ConsTable {
+public:
+  Ref<Node> intern(Node &&candidate) {
+    size_t h = shallowHash(candidate);
+    Slot *free = nullptr;
+    for (size_t i = h & mask();; i = (i + 1) & mask()) {
+      Slot &slot = slots[i];
+      if (!slot.node) {
+        if (!free)
+          free = &slot;
+        break;
+      }
+      if (slot.node == tombstone()) {
+        if (!free)
+          free = &slot;
+        continue;
+      }
+      if (slot.hash == h && shallowEqual(*slot.node, candidate))
+        return Ref<Node>(slot.node);
+    }
+
+    auto node = makeRef<Node>(std::move(candidate));
+    node->interned = true;
+    if (!free->node)
+      used++;
+    *free = {h, node.get()};
+    live++;
+    if (used * 4 > slots.size() * 3)
+      rehash();
+    return node;
+  }
+
+  void erase(const Node &node) {
+    for (size_t i = shallowHash(node) & mask(); slots[i].node;
+         i = (i + 1) & mask())
+      if (slots[i].node == &node) {
+        slots[i].node = tombstone();
+        live--;
+        return;
+      }
+  }
+
+private:
+  struct Slot {
+    size_t hash;
+    Node *node; // nullptr when empty
+  };
+
+  std::vector<Slot> slots = std::vector<Slot>(1024);
+  size_t live = 0; // slots holding a node
+  size_t used = 0; // slots holding a node or a tombstone
+
+  size_t mask() const { return slots.size() - 1; }
+  static Node *tombstone() {
+    static char marker;
+    return reinterpret_cast<Node *>(&marker);
+  }
+
+  // Drops the tombstones, growing so live nodes fill at most half the table
+  void rehash() {
+    size_t size = slots.size();
+    while (live * 2 > size)
+      size *= 2;
+    std::vector<Slot> old(size);
+    old.swap(slots);
+    for (auto &slot : old) {
+      if (!slot.node || slot.node == tombstone())
+        continue;
+      size_t i = slot.hash & mask();
+      while (slots[i].node)
+        i = (i + 1) & mask();
+      slots[i] = slot;
+    }
+    used = live;
+  }
+};
+
+} // namespace
+
+// Nodes are interned in the tables of the arena they are allocated from, so
+// each context hash-conses its own
+struct ConsTables {
+  ConsTable<TypeNode> types;
+  ConsTable<TermNode> terms;
+};
+
+void freeConsTables(ConsTables *tables) { delete tables; }
+
+namespace {
+
+// Immortal nodes, built with no arena, are shared by every thread. Never
+// destroyed, static nodes elsewhere may outlive any destructor order
+ConsTables &immortalTables() {
+  static auto *tables = new ConsTables;
+  return *tables;
+}
+std::mutex immortalLock;
+
+ConsTables &tablesOf(NodeArena *arena) {
+  if (!arena)
+    return immortalTables();
+  if (!arena->tables)
+    arena->tables = new ConsTables;
+  return *arena->tables;
+}
+
+template <typename Node>
+Ref<Node> internIn(Node &&node, ConsTable<Node> ConsTables::*table) {
+  if (currentArena)
+    return (tablesOf(currentArena).*table).intern(std::move(node));
+  std::lock_guard<std::mutex> guard(immortalLock);
+  return (immortalTables().*table).intern(std::move(node));
+}
+
+} // namespace
+
+Type TypeNode::intern(TypeNode node) {
+  return internIn(std::move(node), &ConsTables::types);
+}
+
+Type TypeNode::Unknown() {
+  // Outside any context, e.g. in the types of primitives
+  static std::atomic<uint64_t> unknowns{0};
+  uint64_t n = currentContext ? currentContext->freshUnknown() : unknowns++;
+  return makeRef<TypeNode>(TUnknown, "?t" + std::to_string(n));
+}
+
+// Immortal nodes never die, so only arena tables are erased from
+TypeNode::~TypeNode() {
+  if (interned)
+    tablesOf(arena).types.erase(*this);
+}
+
+Term TermNode::intern(TermNode node) {
+  return internIn(std::move(node), &ConsTables::terms);
+}
+
+/*
+    Singletons
+    ----------
+    The constants every program is full of are built once, outside any
+    arena, so they are immortal and shared by every context: making one
+    costs no allocation and no table lookup
+*/
+namespace {
+
+constexpr int SMALL_INT_MIN = -128, SMALL_INT_MAX = 1023;
+
+// Out of line: inlined into the constructor below, GCC 12 sees which
+// alternative each payload holds and warns that moving it may read the
+// others uninitialized
+[[gnu::noinline]] Term singleton(TermNode::Kind kind, TermNode::Payload payload,
+                                 const Type &type) {
+  return TermNode::intern(TermNode{kind, std::move(payload), type});
+}
+
+struct Singletons {
+  Type types[TypeNode::TString + 1];
+  Term unit, bools[2], emptyString;
+  std::vector<Term> smallInts;
+
+  Singletons() {
+    for (auto kind : {TypeNode::TUnit, TypeNode::TBool, TypeNode::TInt,
+                      TypeNode::TFloat, TypeNode::TString})
+      types[kind] = TypeNode::intern(TypeNode{kind, {}});
+
+    unit = singleton(TermNode::TmUnit, {}, types[TypeNode::TUnit]);
+    for (bool b : {false, true})
+      bools[b] = singleton(TermNode::TmBool, b, types[TypeNode::TBool]);
+    emptyString =
+        singleton(TermNode::TmString, std::string(), types[TypeNode::TString]);
+    for (int i = SMALL_INT_MIN; i <= SMALL_INT_MAX; i++)
+      smallInts.push_back(singleton(TermNode::TmInt, i, types[TypeNode::TInt]));
+  }
+};
+
+const Singletons &singletons() {
+  static const Singletons *s = outsideArena([] { return new Singletons; });
+  return *s;
+}
+
+} // namespace
+
+const Type &TypeNode::base(Kind kind) { return singletons().types[kind]; }
+
+Term TermNode::Unit() { return singletons().unit; }
+
+Term TermNode::Bool(bool b) { return singletons().bools[b]; }
+
+Term TermNode::Int(int i) {
+  if (SMALL_INT_MIN <= i && i <= SMALL_INT_MAX)
+    return singletons().smallInts[i - SMALL_INT_MIN];
+  return intern(TermNode{TmInt, i, TypeNode::Int()});
+}
+
+Term TermNode::String(std::string s) {
+  if (s.empty())
+    return singletons().emptyString;
+  return intern(TermNode{TmString, std::move(s), TypeNode::String()});
+}
+
+TermNode::~TermNode() {
+  if (interned)
+    tablesOf(arena).terms.erase(*this);
+
+  // Children that would die with this node are queued and released by the
+  // outermost destructor, so freeing a long spine does not recurse
+  static thread_local std::vector<Term> pending;
+  static thread_local bool draining = false;
+
+  auto release = [](Term &child) {
+    if (child && child.use_count() == 1)
+      pending.push_back(std::move(child));
+  };
+
+  switch (kind) {
+  case TmTuple: {
+    auto &tp = std::get<Tuple>(payload);
+    release(tp.left);
+    release(tp.right);
+    break;
+  }
+  case TmLet: {
+    auto &lt = std::get<Let>(payload);
+    release(lt.e1);
+    release(lt.e2);
+    break;
+  }
+  case TmAbs:
+    release(std::get<Abs>(payload).body);
+    break;
+  case TmApp: {
+    auto &ap = std::get<App>(payload);
+    release(ap.f);
+    release(ap.arg);
+    break;
+  }
+  default:
+    break;
+  }
+
+  if (draining)
+    return;
+  draining = true;
+  while (!pending.empty()) {
+    Term t = std::move(pending.back());
+    pending.pop_back();
+  }
+  draining = false;
+}
+
+bool termLargerThan(Term t, size_t limit) {
+  std::vector<const TermNode *> work = {t.get()};
+  size_t count = 0;
+
+  while (!work.empty()) {
+    const TermNode *n = work.back();
+    work.pop_back();
+    if (++count > limit)
+      return true;
+
+    switch (n->kind) {
+    case TermNode::TmTuple: {
+      auto &tp = std::get<TermNode::Tuple>(n->payload);
+      work.push_back(tp.left.get());
+      work.push_back(tp.right.get());
+      break;
+    }
+    case TermNode::TmLet: {
+      auto &lt = std::get<TermNode::Let>(n->payload);
+      work.push_back(lt.e1.get());
+      work.push_back(lt.e2.get());
+      break;
+    }
+    case TermNode::TmAbs:
+      work.push_back(std::get<TermNode::Abs>(n->payload).body.get());
+      break;
+    case TermNode::TmApp: {
+      auto &ap = std::get<TermNode::App>(n->payload);
+      work.push_back(ap.f.get());
+      work.push_back(ap.arg.get());
+      break;
+    }
+    default:
+      break;
+    }
+  }
+  return false;
+}
@@ -1,5 +1,7 @@
 #pragma once
 #include "../utils.h"
+#include "ref.h"
+#include "symbol.h"
 #include <iostream>
 #include <memory>
 #include <optional>
@@ -10,14 +12,13 @@
 
 struct TypeNode;
 struct TermNode;
+struct Primitive;
 
-using Type = std::shared_ptr<TypeNode>;
-using Term = std::shared_ptr<const TermNode>;
-using Arg = std::pair<std::string, Type>;
+using Type = Ref<TypeNode>;
+using Term = Ref<const TermNode>;
+using Arg = std::pair<Symbol, Type>;
 
-static unsigned long int unk = 0;
-
-struct TypeNode {
+struct TypeNode : RefCounted {
   enum Kind {
     TUnknown,
     TUnit,
@@ -44,69 +45,56 @@ struct TypeNode {
   using Payload =
       std::variant<std::monostate, std::string, Tuple, Arrow, TypeVar>;
   Payload payload;
+  bool interned = false; // owned by the hash-consing table, see intern()
+
+  // Structurally equal types other than variables share one node. Type
+  // variables are updated in place by unify(), so each stays distinct
+  static Type intern(TypeNode node);
+  static const Type &base(Kind kind);
+
+  TypeNode(Kind kind, Payload payload)
+      : kind(kind), payload(std::move(payload)) {}
 
   // ---- Factory constructors ----
-  static Type Unknown() {
-    return std::make_shared<TypeNode>(
-        TypeNode{TUnknown, "?t" + std::to_string(unk++)});
-  }
-  static Type Unit() { return std::make_shared<TypeNode>(TypeNode{TUnit, {}}); }
-  static Type Bool() { return std::make_shared<TypeNode>(TypeNode{TBool, {}}); }
-  static Type Int() { return std::make_shared<TypeNode>(TypeNode{TInt, {}}); }
-  static Type Float() {
-    return std::make_shared<TypeNode>(TypeNode{TFloat, {}});
-  }
-  static Type String() {
-    return std::make_shared<TypeNode>(TypeNode{TString, {}});
-  }
+  // Named `?tN`, numbered per context
+  static Type Unknown();
+  // Base types are immortal singletons, see syntax.cpp
+  static Type Unit() { return base(TUnit); }
+  static Type Bool() { return base(TBool); }
+  static Type Int() { return base(TInt); }
+  static Type Float() { return base(TFloat); }
+  static Type String() { return base(TString); }
 
   static Type TupleType(Type a, Type b) {
-    return std::make_shared<TypeNode>(TypeNode{TTuple, Tuple{a, b}});
+    return intern(TypeNode{TTuple, Tuple{std::move(a), std::move(b)}});
   }
 
   static Type ArrowType(Type p, Type r) {
-    return std::make_shared<TypeNode>(TypeNode{TArrow, Arrow{p, r}});
+    return intern(TypeNode{TArrow, Arrow{std::move(p), std::move(r)}});
   }
 
   static Type gentyp(void) {
-    return std::make_shared<TypeNode>(TypeNode{TVar, TypeVar{std::nullopt}});
+    return makeRef<TypeNode>(TVar, TypeVar{std::nullopt});
   }
 
   static Type gentyp(Type t) {
-    return std::make_shared<TypeNode>(
-        TypeNode{TVar, TypeVar{std::make_optional<Type>(t)}});
+    return makeRef<TypeNode>(TVar, TypeVar{std::make_optional<Type>(t)});
   }
 
-  bool operator==(const TypeNode &other) const {
-    if (this->kind != other.kind)
-      return false;
-
-    switch (this->kind) {
-      // case TypeNode::TUnknown: {
-      //   auto &A = std::get<std::string>(this->payload);
-      //   auto &B = std::get<std::string>(other.payload);
-      //   return A == B;
-      // }
-
-    case TypeNode::TTuple: {
-      auto &A = std::get<TypeNode::Tuple>(this->payload);
-      auto &B = std::get<TypeNode::Tuple>(other.payload);
-      return *A.left == *B.left && *A.right == *B.right;
-    }
-    case TypeNode::TArrow: {
-      auto &A = std::get<TypeNode::Arrow>(this->payload);
-      auto &B = std::get<TypeNode::Arrow>(other.payload);
-      return *A.param == *B.param && *A.result == *B.result;
-    }
-    default:
-      return true;
-    }
-  }
+  TypeNode(const TypeNode &) = default;
+  TypeNode(TypeNode &&) = default;
+  TypeNode &operator=(const TypeNode &) = default;
+  TypeNode &operator=(TypeNode &&) = default;
+  // Leaves the hash-consing table
+  ~TypeNode();
 
+  // Interned types are equal exactly when they are the same node, type
+  // variables compare by identity
+  bool operator==(const TypeNode &other) const { return this == &other; }
   bool operator!=(const TypeNode &other) const { return !(*this == other); }
 };
 
-struct TermNode {
+struct TermNode : RefCounted {
   enum Kind {
     TmUnit,
     TmBool,
@@ -117,19 +105,20 @@ struct TermNode {
     TmLet,
     TmAbs,
     TmApp,
-    TmVar
+    TmVar,
+    TmPrim
   } kind;
 
   struct Tuple {
     Term left, right;
   };
   struct Let {
-    std::string name;
+    Symbol name;
     Type type;
     Term e1, e2;
   };
   struct Abs {
-    std::string param;
+    Symbol param;
     Type paramType;
     Term body;
   };
@@ -137,129 +126,108 @@ struct TermNode {
     Term f, arg;
   };
   struct Var {
-    std::string name;
-    int index;
+    Symbol name;
+    int index; // de Bruijn index once resolved, see passes/resolve.cpp
+
+    // Index of a variable not bound by any enclosing binder
+    static constexpr int Free = -1;
+  };
+  // Reference to a primitive, resolved once by resolve()
+  struct Prim {
+    Symbol name;
+    const Primitive *prim;
   };
 
   using Payload = std::variant<std::monostate, bool, int, double, std::string,
-                               Tuple, Let, Abs, App, Var>;
+                               Tuple, Let, Abs, App, Var, Prim>;
 
   Payload payload;
-  Type type; // optional annotated type
+  Type type;             // optional annotated type
+  bool interned = false; // owned by the hash-consing table, see intern()
+
+  // Every term is hash-consed: structurally equal terms (same kind, payload
+  // and type, with children compared by pointer) share one node
+  static Term intern(TermNode node);
+
+  TermNode(Kind kind, Payload payload, Type type)
+      : kind(kind), payload(std::move(payload)), type(std::move(type)) {}
 
   // ---- Factory functions ----
-  static Term Unit() {
-    return std::make_shared<TermNode>(TermNode{TmUnit, {}, TypeNode::Unit()});
-  }
-  static Term Bool(bool b) {
-    return std::make_shared<TermNode>(TermNode{TmBool, b, TypeNode::Bool()});
-  }
-  static Term Int(int i) {
-    return std::make_shared<TermNode>(TermNode{TmInt, i, TypeNode::Int()});
-  }
+  // Unit, the booleans, small integers and the empty string are immortal
+  // singletons, see syntax.cpp
+  static Term Unit();
+  static Term Bool(bool b);
+  static Term Int(int i);
   static Term Float(double f) {
-    return std::make_shared<TermNode>(TermNode{TmFloat, f, TypeNode::Float()});
+    return intern(TermNode{TmFloat, f, TypeNode::Float()});
   }
-  static Term String(std::string s) {
-    return std::make_shared<TermNode>(
-        TermNode{TmString, std::move(s), TypeNode::String()});
+  static Term String(std::string s);
+
+  static Term VarTerm(Symbol name, int index, Type t = TypeNode::Unknown()) {
+    return intern(TermNode{TmVar, Var{name, index}, std::move(t)});
   }
 
-  static Term VarTerm(std::string name, int index,
-                      Type t = TypeNode::Unknown()) {
-    return std::make_shared<TermNode>(TermNode{TmVar, Var{name, index}, t});
+  static Term PrimTerm(Symbol name, const Primitive *prim, Type t) {
+    return intern(TermNode{TmPrim, Prim{name, prim}, std::move(t)});
   }
 
   static Term TupleTerm(Term a, Term b) {
-    return std::make_shared<TermNode>(
-        TermNode{TmTuple, Tuple{a, b}, TypeNode::TupleType(a->type, b->type)});
+    Type t = TypeNode::TupleType(a->type, b->type);
+    return intern(
+        TermNode{TmTuple, Tuple{std::move(a), std::move(b)}, std::move(t)});
   }
 
-  static Term LetTerm(std::string name, Type type, Term e1, Term e2) {
-    return std::make_shared<TermNode>(
-        TermNode{TmLet, Let{name, type, e1, e2}, e2->type});
+  static Term LetTerm(Symbol name, Type type, Term e1, Term e2) {
+    Type t = e2->type;
+    return intern(TermNode{TmLet,
+                           Let{name, std::move(type), std::move(e1),
+                               std::move(e2)},
+                           std::move(t)});
   }
 
-  static Term Func(std::string name, std::vector<Arg> args, Term body,
+  static Term Func(Symbol name, std::vector<Arg> args, Term body,
                    Term in) {
     Type t = body->type ? body->type : TypeNode::Unknown();
-    Term abs = body;
-    for (int i = args.size() - 1; i >= 0; i--) {
-      t = TypeNode::ArrowType(args.at(i).second, t);
-      abs = AbsTerm(args.at(i).first, args.at(i).second, abs);
+    Term abs = std::move(body);
+    for (size_t i = args.size(); i-- > 0;) {
+      auto &[param, pty] = args[i];
+      t = TypeNode::ArrowType(pty, std::move(t));
+      abs = AbsTerm(param, std::move(pty), std::move(abs));
     }
 
-    return std::make_shared<TermNode>(
-        TermNode{TmLet, Let{name, t, abs, in}, in->type});
+    Type result = in->type;
+    return intern(TermNode{TmLet, Let{name, std::move(t), std::move(abs),
+                                      std::move(in)},
+                           std::move(result)});
   }
 
-  static Term AbsTerm(std::string param, Type pty, Term body) {
+  static Term AbsTerm(Symbol param, Type pty, Term body) {
     Type t = TypeNode::ArrowType(pty, body->type);
-    return std::make_shared<TermNode>(
-        TermNode{TmAbs, Abs{param, pty, body}, t});
+    return intern(TermNode{TmAbs, Abs{param, std::move(pty), std::move(body)},
+                           std::move(t)});
   }
 
   static Term AppTerm(Term f, Term arg) {
-    return std::make_shared<TermNode>(TermNode{TmApp, App{f, arg}, nullptr}
-                                      // type assigned after inference
+    return intern(TermNode{TmApp, App{std::move(f), std::move(arg)}, nullptr}
+                  // type assigned after inference
     );
   }
 
-  bool operator==(const TermNode &other) const {
-    if (this->kind != other.kind)
-      return false;
-
-    switch (this->kind) {
-    case TermNode::TmUnit:
-      return true;
-    case TermNode::TmBool:
-      return std::get<bool>(this->payload) == std::get<bool>(other.payload);
-    case TermNode::TmInt:
-      return std::get<int>(this->payload) == std::get<int>(other.payload);
-    case TermNode::TmFloat:
-      return std::get<double>(this->payload) == std::get<double>(other.payload);
-    case TermNode::TmString:
-      return std::get<std::string>(this->payload) ==
-             std::get<std::string>(other.payload);
-
-    case TermNode::TmVar: {
-      auto &A = std::get<TermNode::Var>(this->payload);
-      auto &B = std::get<TermNode::Var>(other.payload);
-      return A.name == B.name && A.index == B.index;
-    }
-
-    case TermNode::TmTuple: {
-      auto &A = std::get<TermNode::Tuple>(this->payload);
-      auto &B = std::get<TermNode::Tuple>(other.payload);
-      return *A.left == *B.left && *A.right == *B.right;
-    }
-
-    case TermNode::TmLet: {
-      auto &A = std::get<TermNode::Let>(this->payload);
-      auto &B = std::get<TermNode::Let>(other.payload);
-      return A.name == B.name && A.type == B.type && *A.e1 == *B.e1 &&
-             *A.e2 == *B.e2;
-    }
-
-    case TermNode::TmAbs: {
-      auto &A = std::get<TermNode::Abs>(this->payload);
-      auto &B = std::get<TermNode::Abs>(other.payload);
-      return A.param == B.param && A.paramType == B.paramType &&
-             *A.body == *B.body;
-    }
-
-    case TermNode::TmApp: {
-      auto &A = std::get<TermNode::App>(this->payload);
-      auto &B = std::get<TermNode::App>(other.payload);
-      return *A.f == *B.f && *A.arg == *B.arg;
-    }
-    }
-
-    return false;
-  }
+  TermNode(const TermNode &) = default;
+  TermNode(TermNode &&) = default;
+  TermNode &operator=(const TermNode &) = default;
+  TermNode &operator=(TermNode &&) = default;
+  // Leaves the hash-consing table and releases children iteratively, see
+  // syntax.cpp
+  ~TermNode();
 
+  // Terms are hash-consed, so structural equality is identity
+  bool operator==(const TermNode &other) const { return this == &other; }
   bool operator!=(const TermNode &other) const { return !(*this == other); }
 };
 
 std::string stringOfType(Type t);
 std::string stringOfTerm(Term t, int depth = 0);
+
+// Whether `t` has more than `limit` nodes (stops counting at the limit)
+bool termLargerThan(Term t, size_t limit);
@@ -1,9 +1,15 @@
 #include "globals.h"
-#include "lang/interpreter.h"
+#include "lang/image.h"
+#include "lang/session.h"
 #include "ui.h"
 #include <3ds.h>
+#include <fstream>
+#include <memory>
+#include <sstream>
 
-void stepCallback(State state) {}
+// Time a running program gets per frame, the rest keeps HOME, vblank and
+// input handling responsive
+#define FRAME_BUDGET_US 12000
 
 int main(int argc, char **argv) {
   gfxInitDefault();
@@ -16,6 +22,11 @@ int main(int argc, char **argv) {
   status_message("Try romfs:/ex/{io,func}.ml!");
 
   bool logo_cleared = false;
+  // Of the open file. Running it again only runs the phrases edited or
+  // added since, in the definitions of those before
+  std::unique_ptr<Session> session;
+  std::string sessionFile;
+  bool running = false;
 
   Result rc = romfsInit();
   if (rc)
@@ -29,6 +40,17 @@ int main(int argc, char **argv) {
     u32 kDown = hidKeysDown();
     u32 kHeld = hidKeysHeld();
 
+    if (running) {
+      if (kDown & KEY_START) {
+        session->cancel();
+        running = false;
+        status_message("Cancelled");
+      } else if (session->run({.micros = FRAME_BUDGET_US}) != OutOfFuel) {
+        running = false;
+      }
+      continue;
+    }
+
     if ((kDown | kHeld) && !logo_cleared) {
       clear_top_screen();
       logo_cleared = true;
@@ -44,7 +66,18 @@ int main(int argc, char **argv) {
       if (do_run) {
         // clear_top_screen();
         saveFile(currentFilename);
-        interpreterMain(currentFilename);
+        std::ifstream in(currentFilename);
+        std::ostringstream source;
+        source << in.rdbuf();
+        // A file opened anew runs from its image if it is fresh
+        if (!session || sessionFile != currentFilename) {
+          session = std::make_unique<Session>();
+          session->output = OutChannel::PerRun;
+          session->loadImage(source.str(), imagePath(currentFilename));
+          sessionFile = currentFilename;
+        }
+        session->load(source.str());
+        running = true;
       }
     }
   }